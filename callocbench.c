@@ -0,0 +1,154 @@
+/*
+ * callocbench.c - calloc benchmark for mm.c
+ *
+ * Callocs a stream of 16-38 KB blocks. After every second request an
+ * older block, picked at random, is freed, so requests that fit in the
+ * holes reuse memory that was handed out before, and the others take
+ * memory the heap has never handed out. Only the first bytes of each
+ * block are written, like a caller that fills in a header and leaves
+ * the rest of the zeroed buffer for later.
+ *
+ * The loop runs twice on a fresh heap with its pages purged: once with
+ * mm_calloc, and once with mm_malloc followed by a memset of the whole
+ * request, which is what calloc costs when it cannot tell which memory
+ * is still zero. Each reports the fastest of several runs and the page
+ * faults that run took.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define DEFAULT_BLOCKS 2000
+#define DEFAULT_RUNS   5
+#define MIN_SIZE  (16 * 1024)
+#define MAX_SIZE  (38 * 1024)
+#define TOUCHED   64     /* bytes written at the start of each block */
+
+static double ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1e9 + ts->tv_nsec;
+}
+
+static long minor_faults(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt;
+}
+
+/*
+ * run - one pass over nblocks requests on a fresh heap; returns the
+ *     wall time in ns and leaves the page faults it took in *faults
+ */
+static double run(int nblocks, int clear, long *faults)
+{
+	char **slot;
+	struct timespec t0, t1;
+	unsigned int seed = 1;
+	size_t size;
+	long f0;
+	int i, j;
+
+	if ((slot = calloc(nblocks, sizeof(*slot))) == NULL) {
+		fprintf(stderr, "calloc failed\n");
+		exit(1);
+	}
+	mem_reset_brk();
+	mem_purge_all();
+	if (mm_init() < 0) {
+		fprintf(stderr, "mm_init failed\n");
+		exit(1);
+	}
+
+	f0 = minor_faults();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nblocks; i++) {
+		size = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE + 1);
+		if (clear) {
+			if ((slot[i] = mm_malloc(size)) != NULL)
+				memset(slot[i], 0, size);
+		} else
+			slot[i] = mm_calloc(1, size);
+		if (slot[i] == NULL) {
+			fprintf(stderr, "allocation %d failed\n", i);
+			exit(1);
+		}
+		memset(slot[i], i, TOUCHED);
+		/* every second request frees an older block for reuse */
+		if (i % 2 == 1) {
+			j = rand_r(&seed) % i;
+			while (slot[j] == NULL)
+				j = (j + 1) % i;
+			mm_free(slot[j]);
+			slot[j] = NULL;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	*faults = minor_faults() - f0;
+
+	for (i = 0; i < nblocks; i++)
+		mm_free(slot[i]);
+	free(slot);
+	return ts_ns(&t1) - ts_ns(&t0);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: callocbench [-h] [-n <blocks>] [-r <runs>]\n");
+	fprintf(stderr, "\t-n <blocks>  Blocks allocated per run (default %d).\n",
+			DEFAULT_BLOCKS);
+	fprintf(stderr, "\t-r <runs>    Runs per mode; the fastest counts (default %d).\n",
+			DEFAULT_RUNS);
+}
+
+int main(int argc, char **argv)
+{
+	static const char *modes[2] = { "calloc", "memset" };
+	int nblocks = DEFAULT_BLOCKS, runs = DEFAULT_RUNS;
+	double ns, best;
+	long faults, best_faults = 0;
+	int c, clear, r;
+
+	while ((c = getopt(argc, argv, "n:r:h")) != EOF) {
+		switch (c) {
+			case 'n':
+				nblocks = atoi(optarg);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				usage();
+				exit(c == 'h' ? 0 : 1);
+		}
+	}
+	if (nblocks < 1 || runs < 1) {
+		usage();
+		exit(1);
+	}
+
+	mem_init();
+	printf("%8s%10s%10s%10s\n", "mode", "ms", "ns/op", "faults");
+	for (clear = 0; clear < 2; clear++) {
+		best = 0;
+		for (r = 0; r < runs; r++) {
+			ns = run(nblocks, clear, &faults);
+			if (r == 0 || ns < best) {
+				best = ns;
+				best_faults = faults;
+			}
+		}
+		printf("%8s%10.2f%10.0f%10ld\n",
+				modes[clear], best / 1e6, best / nblocks, best_faults);
+	}
+	mem_deinit();
+	return 0;
+}
@@ -86,14 +86,26 @@
 #define UTIL_WEIGHT .63
 
 /*
- * Alignment requirement in bytes (either 4 or 8)
+ * Alignment requirement in bytes (4, 8 or 16). Build with -DALIGN16 to
+ * check the 16-byte alignment of max_align_t on x86-64.
  */
+#ifdef ALIGN16
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8
+#endif
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes. The 64-bit heap layout (-DHEAP64) lifts
+ * the 4 GB limit of 32-bit headers, so its default is much larger.
  */
+#ifndef MAX_HEAP
+#ifdef HEAP64
+#define MAX_HEAP (64UL << 30)  /* 64 GB */
+#else
 #define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#endif
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -9,15 +9,20 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 #include "mm.h"
@@ -37,6 +42,15 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define RESIDENT_SAMPLES 64 /* resident size samples per trace (-S only) */
+#define MAXTHREADS   256 /* most threads in a -T replay */
+#define REPLAY_RUNS    5 /* -T replays per thread count; the fastest counts */
+#define STREAM_WINDOW (1 << 16) /* requests per window of a -B replay */
+#define NUM_OPTYPES    5 /* ALLOC, FREE, REALLOC, MEMALIGN, CALLOC */
+#define RANGE_CHUNK 4096 /* range records allocated at a time */
+#define LAT_SUB_BITS   2
+#define LAT_SUB (1 << LAT_SUB_BITS) /* latency buckets per power of two (-H only) */
+#define LAT_BUCKETS  256 /* enough for any 64-bit cycle count */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
@@ -52,25 +66,60 @@
  * Remember that index (-1) is the null pointer.
  */
 
-/* Records the extent of each block's payload */
+/*
+ * Records the extent of each block's payload. The records form a treap
+ * keyed by lo: a binary search tree that is also a heap on random
+ * priorities, so it stays balanced whatever order blocks come in.
+ */
 typedef struct range_t {
 	char *lo;              /* low payload address */
 	char *hi;              /* high payload address */
-	struct range_t *next;  /* next list element */
+	struct range_t *left;  /* ranges below lo; next free record in the pool */
+	struct range_t *right; /* ranges above hi */
+	unsigned int prio;     /* no lower than the priorities below it */
 	int index;             /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* Types of request */
+enum { ALLOC, FREE, REALLOC, MEMALIGN, CALLOC };
+
+/*
+ * Characterizes a single trace operation (allocator request). This is
+ * also the record of a binary trace file, so the fields have fixed
+ * widths and a binary trace is replayed straight from its mapping.
+ */
 typedef struct {
-	enum { ALLOC, FREE, REALLOC } type; /* type of request */
-	int index;                        /* index for free() to use later */
-	size_t size;                      /* byte size of alloc/realloc request */
+	uint32_t type;    /* ALLOC, FREE, REALLOC, MEMALIGN or CALLOC */
+	int32_t index;    /* index for free() to use later */
+	uint32_t size;    /* byte size of alloc/realloc/calloc request */
+	uint32_t align;   /* alignment of a memalign request */
 } traceop_t;
 
+/*
+ * A binary trace file (made by traces/rep2bin.pl) starts with this
+ * header, little-endian like the ops. The header of a text trace has
+ * the same four numbers. Without TRACE_VARINT the ops follow as
+ * traceop_t records; with it each op is a type byte, the varint of the
+ * zigzagged difference from the previous op's index, and, unless it is
+ * a free, varints of its size and (for memalign) its alignment.
+ */
+#define TRACE_MAGIC "MMTRACE1"
+#define TRACE_VARINT 0x1
+
+typedef struct {
+	char magic[8];          /* TRACE_MAGIC */
+	uint32_t flags;         /* TRACE_VARINT if the ops are encoded */
+	uint32_t weight;
+	uint32_t num_ids;
+	uint32_t num_ops;
+	uint32_t ignore_ranges;
+	uint32_t reserved;      /* zero */
+} tracehdr_t;
+
 /* Holds the information for one trace file*/
 typedef struct {
 	char filename[MAXLINE];
-	int ignore_ranges;   /* don't check ranges (i.e. this is too big) */
+	int ignore_ranges;   /* unused: ranges are cheap to check on any trace */
 	int num_ids;         /* number of alloc/realloc ids */
 	int num_ops;         /* number of distinct requests */
 	int weight;          /* weight for this trace (unused) */
@@ -78,6 +127,8 @@ typedef struct {
 	char **blocks;       /* array of ptrs returned by malloc/realloc... */
 	size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 	int *block_rand_base;/* index into random_data, if debug is on */
+	void *map;           /* mapping of a binary trace that ops points into */
+	size_t map_size;     /* ... and its length */
 } trace_t;
 
 /*
@@ -90,6 +141,53 @@ typedef struct {
 	range_t *ranges;
 } speed_t;
 
+/*
+ * One thread of a -T replay. The trace's ids are dealt out round-robin,
+ * so a thread runs every request on its ids, in trace order, and no two
+ * threads touch the same block.
+ */
+typedef struct {
+	pthread_t tid;
+	trace_t *trace;
+	int *opnums;      /* the requests this thread replays */
+	int num_ops;      /* ... and how many there are */
+	char **blocks;    /* this thread's block pointers, indexed by id */
+	int libc;         /* replay against libc malloc instead of mm */
+	struct timespec t0, t1; /* when this thread started and finished */
+	double secs;      /* wall time of this thread's replay */
+} replay_t;
+
+/*
+ * Latency histogram of one request type (-H only). Counts are bucketed
+ * by the log of the cycles a request took, LAT_SUB buckets per power of
+ * two, so every bucket is within 25% of its lower bound.
+ */
+typedef struct {
+	unsigned long count[LAT_BUCKETS];
+	unsigned long n;       /* requests timed */
+	unsigned long max;     /* slowest request, in cycles */
+	int max_op;            /* ... and its opnum in the trace */
+} latency_t;
+
+/*
+ * A binary trace streamed through two windows of STREAM_WINDOW requests
+ * (-B only). A reader thread fills one window while the driver replays
+ * the other, so only the requests in the two windows are in memory.
+ */
+typedef struct {
+	char filename[MAXLINE];
+	FILE *file;
+	int varint;             /* ops are varint-encoded (TRACE_VARINT) */
+	unsigned long left;     /* requests not read yet */
+	int32_t index;          /* id of the last request read, for varints */
+	traceop_t *window[2];
+	int count[2];           /* requests in each window; 0 at the end */
+	int full[2];            /* window read and not replayed yet */
+	pthread_t tid;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} stream_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
 	/* set in read_trace */
@@ -103,6 +201,13 @@ typedef struct {
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	mm_stats_t mm;   /* allocator statistics from the utilization run */
+	mm_stats_t mm_eager; /* the same run with quick lists off (-S only) */
+	size_t resident;      /* average resident heap bytes (-S only) */
+	size_t resident_kept; /* the same with purging off (-S only) */
+
+	/* defined for both, per request type (-H only) */
+	latency_t lat[NUM_OPTYPES];
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -135,6 +240,21 @@ int onetime_flag = 0;
 /* by default, no timeouts */
 static int set_timeout = 0;
 
+/* if set, print the allocator statistics table (set by -S) */
+static int print_mmstats = 0;
+
+/* if set, time every request and print latency percentiles (set by -H) */
+static int print_latency = 0;
+
+/* if set, stream the traces instead of loading them (set by -B) */
+static int stream_mode = 0;
+
+/* thread counts for the multi-threaded replay (set by -T) */
+static char *replay_threads = NULL;
+
+/* lines up the threads of a -T replay at its start and end */
+static pthread_barrier_t replay_barrier;
+
 
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
@@ -151,21 +271,24 @@ char autoresult[SUBMITR_MAXBUF]; /* autoresult string */
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range sets */
 static int add_range(range_t **ranges, char *lo, int size,
 		const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static void check_ranges(const trace_t *trace, int opnum, const range_t *r);
 
 /* These functions implement the debugging code */
 static void init_random_data(void);
 static void check_index(const trace_t *trace, int opnum, int index);
+static int check_zeroed(const trace_t *trace, int opnum, int index);
 static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		const char *filename);
 static trace_t *read_trace_stdin(stats_t *stats);
+static int map_trace(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -176,11 +299,30 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util(trace_t *trace, int tracenum, size_t *resident);
 static void eval_mm_speed(void *ptr);
 
+/* Per-request latency histograms (-H) */
+static void eval_latency(trace_t *trace, int libc, latency_t *lat);
+static void printlatency(int n, stats_t *stats);
+
+/* Routines for the multi-threaded replay (-T) */
+static void run_replays(int num_tracefiles, const char *tracedir,
+		char **tracefiles, int run_libc);
+static double eval_replay(trace_t *trace, replay_t *r, int nthreads);
+static void *replay_thread(void *ptr);
+
+/* Routines for the streamed replay (-B) */
+static void run_streams(int num_tracefiles, const char *tracedir,
+		char **tracefiles, int run_libc);
+static void eval_stream(stream_t *st, int libc);
+static void *stream_reader(void *ptr);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printmmstats(int n, stats_t *stats);
+static void printquickstats(int n, stats_t *stats);
+static void printpurgestats(int n, stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	__attribute__((format(printf, 3,4)));
@@ -232,12 +374,33 @@ static void run_tests(int num_tracefiles, char trace_from_stdin,
 		if (mm_stats[i].valid) {
 			if (verbose > 1)
 				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i);
+			mm_stats[i].util = eval_mm_util(trace, i,
+					print_mmstats ? &mm_stats[i].resident : NULL);
+			mm_getstats(&mm_stats[i].mm);
+			if (print_mmstats) {
+				mm_params_t params, nopurge;
+
+				/* rerun coalescing on every free to see what quick lists save */
+				mm_set_quick_lists(0);
+				eval_mm_util(trace, i, NULL);
+				mm_getstats(&mm_stats[i].mm_eager);
+				mm_set_quick_lists(1);
+
+				/* and with purging off, to see how much memory it saves */
+				mm_get_params(&params);
+				nopurge = params;
+				nopurge.purge_decay = 0;
+				mm_set_params(&nopurge);
+				eval_mm_util(trace, i, &mm_stats[i].resident_kept);
+				mm_set_params(&params);
+			}
 			speed_params->trace = trace;
 			speed_params->ranges = ranges;
 			if (verbose > 1)
 				printf("and performance.\n");
 			mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+			if (print_latency)
+				eval_latency(trace, 0, mm_stats[i].lat);
 		}
 		free_trace(trace);
 	}
@@ -278,7 +441,7 @@ int main(int argc, char **argv)
 		num_tracefiles = 1;
 		trace_from_stdin = 1;
 #else
-	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlDj")) != EOF) {
+	while ((c = getopt(argc, argv, "d:f:c:g:s:t:v:hBHT:VAlDjS")) != EOF) {
 		switch (c) {
 
 			case 'A': /* Hidden Autolab driver argument */
@@ -336,6 +499,37 @@ int main(int argc, char **argv)
 				set_timeout = atoi(optarg);
 				break;
 
+			case 'S': /* Print allocator statistics */
+				print_mmstats = 1;
+				break;
+
+			case 'B': /* Stream the traces in windows */
+				stream_mode = 1;
+				break;
+
+			case 'H': /* Print latency percentiles */
+				print_latency = 1;
+				break;
+
+			case 'T': /* Replay each trace on n1,n2,... threads */
+				replay_threads = strdup(optarg);
+				break;
+
+			case 'g': /* Heap policy: min,max,window[,trim,pad[,decay[,map]]] */
+				{
+					mm_params_t params;
+					mm_get_params(&params);
+					if (sscanf(optarg, "%zu,%zu,%lu,%zu,%zu,%lu,%zu", &params.grow_min,
+								&params.grow_max, &params.grow_window,
+								&params.trim_threshold, &params.top_pad,
+								&params.purge_decay, &params.mmap_threshold) < 3) {
+						usage();
+						exit(1);
+					}
+					mm_set_params(&params);
+				}
+				break;
+
 			case 'j': /* For OJ */
 				num_tracefiles = 1;
 				trace_from_stdin = 1;
@@ -374,6 +568,15 @@ int main(int argc, char **argv)
 		signal(SIGALRM, timeout_handler);
 	}
 
+	/* A streamed replay stands in for the whole evaluation */
+	if (stream_mode) {
+		if (trace_from_stdin)
+			app_error("-B needs a binary trace file, not stdin");
+		mem_init();
+		run_streams(num_tracefiles, tracedir, tracefiles, run_libc);
+		exit(0);
+	}
+
 	/*
 	 * Optionally run and evaluate the libc malloc package
 	 */
@@ -401,6 +604,8 @@ int main(int argc, char **argv)
 				if (verbose > 1)
 					printf("and performance.\n");
 				libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+				if (print_latency)
+					eval_latency(trace, 1, libc_stats[i].lat);
 			}
 			free_trace(trace);
 		}
@@ -443,9 +648,28 @@ int main(int argc, char **argv)
 			printf("\nResults for mm malloc:\n");
 			printresults(num_tracefiles, mm_stats);
 			printf("\n");
+			if (print_mmstats) {
+				printf("Allocator statistics for mm malloc:\n");
+				printmmstats(num_tracefiles, mm_stats);
+				printf("\n");
+				printf("Deferred coalescing (quick lists) for mm malloc:\n");
+				printquickstats(num_tracefiles, mm_stats);
+				printf("\n");
+				printf("Purging free pages (madvise) for mm malloc:\n");
+				printpurgestats(num_tracefiles, mm_stats);
+				printf("\n");
+			}
 		}
 	}
 
+	/* Optionally replay the traces again on several threads at once */
+	if (replay_threads != NULL && !onetime_flag) {
+		if (trace_from_stdin)
+			printf("-T ignored: the trace comes from stdin\n\n");
+		else
+			run_replays(num_tracefiles, tracedir, tracefiles, run_libc);
+	}
+
 	/*
 	 * Accumulate the aggregate statistics for the student's mm package
 	 */
@@ -515,27 +739,122 @@ int main(int argc, char **argv)
 			avg_mm_throughput/1000.0, avg_mm_util*100);
 	driver_post(NULL, autoresult, autograder, status_msg);
 
+	/* -f and -c copy their trace name; the defaults are static */
+	if (tracefiles != default_tracefiles) {
+		if (tracefiles != NULL)
+			free(tracefiles[0]);
+		free(tracefiles);
+	}
+	free(libc_stats);
+	free(mm_stats);
 	exit(0);
 }
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range set, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range set to detect any overlapping allocated blocks. The set is a
+ * treap, so each check costs O(log n) and stays on for every trace;
+ * its records come from a pool that is reused from trace to trace.
  ****************************************************************/
 
+static range_t **range_chunks;  /* pool chunks of RANGE_CHUNK records */
+static int range_nchunks;       /* number of chunks allocated */
+static int range_next;          /* next unused record, counting all chunks */
+static range_t *range_free;     /* removed records, linked through left */
+static unsigned int range_seed = 2463534242u; /* xorshift state */
+
+/*
+ * range_alloc - Take a range record from the pool
+ */
+static range_t *range_alloc(void)
+{
+	range_t *p;
+
+	if ((p = range_free) != NULL) {
+		range_free = p->left;
+		return p;
+	}
+	if (range_next == range_nchunks * RANGE_CHUNK) {
+		range_chunks = realloc(range_chunks,
+				(range_nchunks + 1) * sizeof(range_t *));
+		if (range_chunks == NULL ||
+				(range_chunks[range_nchunks] =
+				 malloc(RANGE_CHUNK * sizeof(range_t))) == NULL)
+			unix_error("malloc error in range_alloc");
+		range_nchunks++;
+	}
+	p = &range_chunks[range_next / RANGE_CHUNK][range_next % RANGE_CHUNK];
+	range_next++;
+	return p;
+}
+
+/*
+ * range_split - Split treap t into the ranges below lo and the rest
+ */
+static void range_split(range_t *t, char *lo, range_t **l, range_t **r)
+{
+	if (t == NULL)
+		*l = *r = NULL;
+	else if (t->lo < lo) {
+		range_split(t->right, lo, &t->right, r);
+		*l = t;
+	}
+	else {
+		range_split(t->left, lo, l, &t->left);
+		*r = t;
+	}
+}
+
+/*
+ * range_merge - Join treaps l and r, where every range in l lies below r
+ */
+static range_t *range_merge(range_t *l, range_t *r)
+{
+	if (l == NULL)
+		return r;
+	if (r == NULL)
+		return l;
+	if (l->prio > r->prio) {
+		l->right = range_merge(l->right, r);
+		return l;
+	}
+	r->left = range_merge(l, r->left);
+	return r;
+}
+
+/*
+ * range_insert - Insert record p into treap t and return the new root
+ */
+static range_t *range_insert(range_t *t, range_t *p)
+{
+	if (t == NULL)
+		return p;
+	if (p->prio > t->prio) {
+		range_split(t, p->lo, &p->left, &p->right);
+		return p;
+	}
+	if (p->lo < t->lo)
+		t->left = range_insert(t->left, p);
+	else
+		t->right = range_insert(t->right, p);
+	return t;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range set.
  */
 static int add_range(range_t **ranges, char *lo, int size,
 		const trace_t *trace, int opnum, int index)
 {
 	char *hi = lo + size - 1;
 	range_t *p;
+	range_t *pred = NULL;  /* the range starting closest below lo */
+	range_t *succ = NULL;  /* the range starting closest above lo */
 
 	assert(size > 0);
 
@@ -546,42 +865,54 @@ static int add_range(range_t **ranges, char *lo, int size,
 		return 0;
 	}
 
-	/* The payload must lie within the extent of the heap */
-	if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-			(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+	/* The payload must lie within the heap, a region or a mapping */
+	if (!mem_in_heap(lo, hi)) {
 		malloc_error(trace, opnum,
 				"Payload (%p:%p) lies outside heap (%p:%p)",
 				lo, hi, mem_heap_lo(), mem_heap_hi());
 		return 0;
 	}
 
-	/* If we can't afford the linear-time loop, we check less thoroughly and
-	   just assume the overlap will be caught by writing random bits. */
-	if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
+	/* Without debugging, the random bits will catch most overlaps */
+	if(debug_mode == DBG_NONE) return 1;
 
-
-	/* The payload must not overlap any other payloads */
-	for (p = *ranges;  p != NULL;  p = p->next) {
-		if ((lo >= p->lo && lo <= p-> hi) ||
-				(hi >= p->lo && hi <= p->hi)) {
-			malloc_error(trace, opnum,
-					"Payload (%p:%p) overlaps another payload (%p:%p)\n",
-					lo, hi, p->lo, p->hi);
-			return 0;
+	/*
+	 * The payload must not overlap any other payloads. The ranges in
+	 * the set are disjoint, so only its neighbours by address can.
+	 */
+	for (p = *ranges;  p != NULL; ) {
+		if (p->lo <= lo) {
+			pred = p;
+			p = p->right;
 		}
+		else {
+			succ = p;
+			p = p->left;
+		}
+	}
+	if ((p = pred) == NULL || p->hi < lo)
+		p = succ;
+	if (p != NULL && p->lo <= hi && p->hi >= lo) {
+		malloc_error(trace, opnum,
+				"Payload (%p:%p) overlaps another payload (%p:%p)\n",
+				lo, hi, p->lo, p->hi);
+		return 0;
 	}
 
 	/*
 	 * Everything looks OK, so remember the extent of this block
-	 * by creating a range struct and adding it the range list.
+	 * by taking a range struct from the pool and adding it the range set.
 	 */
-	if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-		unix_error("malloc error in add_range");
-	p->next = *ranges;
+	range_seed ^= range_seed << 13;
+	range_seed ^= range_seed >> 17;
+	range_seed ^= range_seed << 5;
+	p = range_alloc();
 	p->lo = lo;
 	p->hi = hi;
+	p->left = p->right = NULL;
+	p->prio = range_seed;
 	p->index = index;
-	*ranges = p;
+	*ranges = range_insert(*ranges, p);
 
 	return 1;
 }
@@ -593,16 +924,13 @@ static void remove_range(range_t **ranges, char *lo)
 {
 	range_t *p;
 	range_t **prevpp = ranges;
-	int size;
 
-	for (p = *ranges;  p != NULL; p = p->next) {
-		if (p->lo == lo) {
-			*prevpp = p->next;
-			size = p->hi - p->lo + 1;
-			free(p);
-			break;
-		}
-		prevpp = &(p->next);
+	while ((p = *prevpp) != NULL && p->lo != lo)
+		prevpp = lo < p->lo ? &p->left : &p->right;
+	if (p != NULL) {
+		*prevpp = range_merge(p->left, p->right);
+		p->left = range_free;
+		range_free = p;
 	}
 }
 
@@ -611,14 +939,22 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-	range_t *p;
-	range_t *pnext;
+	/* The records all go back to the pool; its chunks are kept */
+	range_next = 0;
+	range_free = NULL;
+	*ranges = NULL;
+}
 
-	for (p = *ranges;  p != NULL;  p = pnext) {
-		pnext = p->next;
-		free(p);
+/*
+ * check_ranges - check the data of every block in the range set
+ */
+static void check_ranges(const trace_t *trace, int opnum, const range_t *r)
+{
+	while (r != NULL) {
+		check_ranges(trace, opnum, r->left);
+		check_index(trace, opnum, r->index);
+		r = r->right;
 	}
-	*ranges = NULL;
 }
 
 /**********************************************
@@ -683,6 +1019,29 @@ static void check_index(const trace_t *trace, int opnum, int index) {
 	}
 }
 
+/*
+ * check_zeroed - Check that a block just returned by calloc reads as
+ *     zeros. Runs whatever the debug mode, since it checks calloc
+ *     itself rather than the blocks the driver wrote.
+ */
+static int check_zeroed(const trace_t *trace, int opnum, int index) {
+	const unsigned char *block = (const unsigned char *)trace->blocks[index];
+	size_t size = trace->block_sizes[index];
+	size_t i, nonzero = 0, first = 0;
+
+	for(i = 0; i < size; i++) {
+		if(block[i] != 0 && nonzero++ == 0)
+			first = i;
+	}
+	if(nonzero != 0) {
+		malloc_error(trace, opnum, "calloc block %d has %zu nonzero byte%s, "
+				"starting at byte %zu", index, nonzero,
+				nonzero > 1 ? "s" : "", first);
+		return 0;
+	}
+	return 1;
+}
+
 /**********************************************
  * The following routines manipulate tracefiles
  *********************************************/
@@ -696,7 +1055,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	FILE *tracefile;
 	trace_t *trace;
 	char type[MAXLINE];
-	int index, size;
+	int index, size, align;
 	int max_index = 0;
 	int op_index;
 
@@ -707,9 +1066,18 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 		unix_error("malloc 1 failed in read_trace");
 
-	/* Read the trace file header */
+	/* A binary trace is mapped, not read */
 	strcpy(trace->filename, tracedir);
 	strcat(trace->filename, filename);
+	trace->map = NULL;
+	if (map_trace(trace)) {
+		strcpy(stats->filename, trace->filename);
+		stats->weight = trace->weight;
+		stats->ops = trace->num_ops;
+		return trace;
+	}
+
+	/* Read the trace file header */
 	if ((tracefile = fopen(trace->filename, "r")) == NULL) {
 		unix_error("Could not open %s in read_trace", trace->filename);
 	}
@@ -765,6 +1133,24 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 				trace->ops[op_index].size = size;
 				max_index = (index > max_index) ? index : max_index;
 				break;
+			case 'm':
+				fscanf(tracefile, "%u %u %u", &index, &size, &align);
+				if (align == 0 || (align & (align - 1)) != 0)
+					app_error("Bad alignment (%u) in tracefile %s\n",
+							align, trace->filename);
+				trace->ops[op_index].type = MEMALIGN;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				trace->ops[op_index].align = align;
+				max_index = (index > max_index) ? index : max_index;
+				break;
+			case 'c':
+				fscanf(tracefile, "%u %u", &index, &size);
+				trace->ops[op_index].type = CALLOC;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				max_index = (index > max_index) ? index : max_index;
+				break;
 			case 'f':
 				fscanf(tracefile, "%ud", &index);
 				trace->ops[op_index].type = FREE;
@@ -797,7 +1183,7 @@ static trace_t *read_trace_stdin(stats_t *stats)
 	FILE *tracefile;
 	trace_t *trace;
 	char type[MAXLINE];
-	int index, size;
+	int index, size, align;
 	int max_index = 0;
 	int op_index;
 
@@ -810,6 +1196,7 @@ static trace_t *read_trace_stdin(stats_t *stats)
 
 	/* Read the trace file header */
 	strcpy(trace->filename, "stdin");
+	trace->map = NULL;
 	tracefile = stdin;
 
 	fscanf(tracefile, "%d", &trace->weight);
@@ -864,6 +1251,23 @@ static trace_t *read_trace_stdin(stats_t *stats)
 				trace->ops[op_index].size = size;
 				max_index = (index > max_index) ? index : max_index;
 				break;
+			case 'm':
+				fscanf(tracefile, "%u %u %u", &index, &size, &align);
+				if (align == 0 || (align & (align - 1)) != 0)
+					app_error("Bad alignment (%u) from stdin\n", align);
+				trace->ops[op_index].type = MEMALIGN;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				trace->ops[op_index].align = align;
+				max_index = (index > max_index) ? index : max_index;
+				break;
+			case 'c':
+				fscanf(tracefile, "%u %u", &index, &size);
+				trace->ops[op_index].type = CALLOC;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].size = size;
+				max_index = (index > max_index) ? index : max_index;
+				break;
 			case 'f':
 				fscanf(tracefile, "%ud", &index);
 				trace->ops[op_index].type = FREE;
@@ -888,6 +1292,119 @@ static trace_t *read_trace_stdin(stats_t *stats)
 	return trace;
 }
 
+/*
+ * get_varint - Decode the varint at *p, no further than end
+ */
+static uint32_t get_varint(const trace_t *trace, const unsigned char **p,
+		const unsigned char *end)
+{
+	uint32_t v = 0;
+	int shift;
+
+	for (shift = 0; shift < 35; shift += 7) {
+		if (*p == end)
+			app_error("%s: truncated binary trace", trace->filename);
+		v |= (uint32_t)(**p & 0x7f) << shift;
+		if ((*(*p)++ & 0x80) == 0)
+			return v;
+	}
+	app_error("%s: bad varint in binary trace", trace->filename);
+}
+
+/*
+ * map_trace - If trace->filename is a binary trace, map it and fill in
+ *     trace, pointing trace->ops into the mapping, and return 1. A
+ *     varint-encoded trace is decoded into a malloc'd array instead.
+ *     Return 0 if the file is not a binary trace.
+ */
+static int map_trace(trace_t *trace)
+{
+	const tracehdr_t *hdr;
+	const unsigned char *p, *end;
+	traceop_t *op;
+	struct stat st;
+	uint32_t z;
+	int fd, i, index, max_index = -1;
+
+	if ((fd = open(trace->filename, O_RDONLY)) < 0)
+		unix_error("Could not open %s in read_trace", trace->filename);
+	if (fstat(fd, &st) < 0)
+		unix_error("Could not stat %s in read_trace", trace->filename);
+	if ((size_t)st.st_size < sizeof(tracehdr_t)) {
+		close(fd);
+		return 0;
+	}
+	trace->map_size = st.st_size;
+	trace->map = mmap(NULL, trace->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (trace->map == MAP_FAILED)
+		unix_error("Could not map %s in read_trace", trace->filename);
+	hdr = trace->map;
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0) {
+		munmap(trace->map, trace->map_size);
+		trace->map = NULL;
+		return 0;
+	}
+
+	trace->weight = hdr->weight;
+	trace->num_ids = hdr->num_ids;
+	trace->num_ops = hdr->num_ops;
+	trace->ignore_ranges = hdr->ignore_ranges;
+	if (trace->weight != 0 && trace->weight != 1)
+		app_error("%s: weight can only be zero or one", trace->filename);
+	if (trace->ignore_ranges != 0 && trace->ignore_ranges != 1)
+		app_error("%s: ignore-ranges can only be zero or one", trace->filename);
+
+	p = (const unsigned char *)(hdr + 1);
+	end = (const unsigned char *)trace->map + trace->map_size;
+	if (hdr->flags & TRACE_VARINT) {
+		if ((trace->ops = malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+			unix_error("malloc 2 failed in read_trace");
+		index = 0;
+		for (i = 0; i < trace->num_ops; i++) {
+			op = &trace->ops[i];
+			if (p == end)
+				app_error("%s: truncated binary trace", trace->filename);
+			op->type = *p++;
+			/* zigzag: even values are >= 0, odd ones negative */
+			z = get_varint(trace, &p, end);
+			index += (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+			op->index = index;
+			op->size = op->type == FREE ? 0 : get_varint(trace, &p, end);
+			op->align = op->type == MEMALIGN ? get_varint(trace, &p, end) : 0;
+		}
+		munmap(trace->map, trace->map_size);
+		trace->map = NULL;
+	} else {
+		if ((size_t)(end - p) / sizeof(traceop_t) < (size_t)trace->num_ops)
+			app_error("%s: truncated binary trace", trace->filename);
+		trace->ops = (traceop_t *)p;
+	}
+
+	/* the ops are trusted no more than a text trace's */
+	for (i = 0; i < trace->num_ops; i++) {
+		op = &trace->ops[i];
+		if (op->type > CALLOC)
+			app_error("%s: bad request type %u at op %d",
+					trace->filename, op->type, i);
+		if (op->type == MEMALIGN && (op->align == 0 || (op->align & (op->align - 1)) != 0))
+			app_error("%s: bad alignment %u at op %d",
+					trace->filename, op->align, i);
+		if (op->index >= trace->num_ids || op->index < (op->type == FREE ? -1 : 0))
+			app_error("%s: bad id %d at op %d", trace->filename, op->index, i);
+		if (op->type != FREE && op->index > max_index)
+			max_index = op->index;
+	}
+	assert(max_index == trace->num_ids - 1);
+
+	if ((trace->blocks = calloc(trace->num_ids, sizeof(char *))) == NULL ||
+			(trace->block_sizes = calloc(trace->num_ids, sizeof(size_t))) == NULL ||
+			(trace->block_rand_base =
+			 calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+		unix_error("malloc 3 failed in read_trace");
+	return 1;
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -904,8 +1421,11 @@ static void reinit_trace(trace_t *trace)
  */
 static void free_trace(trace_t *trace)
 {
-	free(trace->ops);         /* free the three arrays... */
-	free(trace->blocks);
+	if (trace->map != NULL)   /* the ops of a binary trace are mapped */
+		munmap(trace->map, trace->map_size);
+	else
+		free(trace->ops);
+	free(trace->blocks);      /* free the three arrays... */
 	free(trace->block_sizes);
 	free(trace->block_rand_base);
 	free(trace);              /* and the trace record itself... */
@@ -928,7 +1448,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 	char *oldp;
 	char *p;
 
-	/* Reset the heap and free any records in the range list */
+	/* Reset the heap and free any records in the range set */
 	mem_reset_brk();
 	clear_ranges(ranges);
 	reinit_trace(trace);
@@ -945,17 +1465,11 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 		size = trace->ops[i].size;
 
 		if(debug_mode == DBG_EXPENSIVE) {
-			range_t *r;
-			
 			/* Let the students check their own heap */
 			mm_checkheap(verbose);
 
 			/* Now check that all our allocated blocks have the right data */
-			r = *ranges;
-			while(r) {
-				check_index(trace, i, r->index);
-				r = r->next;
-			}
+			check_ranges(trace, i, *ranges);
 		}
 
 		switch (trace->ops[i].type) {
@@ -970,7 +1484,7 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 
 				/*
 				 * Test the range of the new block for correctness and add it
-				 * to the range list if OK. The block must be  be aligned properly,
+				 * to the range set if OK. The block must be  be aligned properly,
 				 * and must not overlap any currently allocated block.
 				 */
 				if (add_range(ranges, p, size, trace, i, index) == 0)
@@ -984,6 +1498,37 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				randomize_block(trace, index);
 				break;
 
+			case MEMALIGN: /* mm_memalign */
+				if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+					malloc_error(trace, i, "mm_memalign failed.");
+					return 0;
+				}
+				if ((unsigned long)p % trace->ops[i].align != 0) {
+					malloc_error(trace, i, "Payload address (%p) not aligned to %u bytes",
+							p, trace->ops[i].align);
+					return 0;
+				}
+				if (add_range(ranges, p, size, trace, i, index) == 0)
+					return 0;
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				randomize_block(trace, index);
+				break;
+
+			case CALLOC: /* mm_calloc */
+				if ((p = mm_calloc(1, size)) == NULL) {
+					malloc_error(trace, i, "mm_calloc failed.");
+					return 0;
+				}
+				if (add_range(ranges, p, size, trace, i, index) == 0)
+					return 0;
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+				if (check_zeroed(trace, i, index) == 0)
+					return 0;
+				randomize_block(trace, index);
+				break;
+
 			case REALLOC: /* mm_realloc */
 				check_index(trace, i, index);
 
@@ -1001,10 +1546,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				}
 
 
-				/* Remove the old region from the range list */
+				/* Remove the old region from the range set */
 				remove_range(ranges, oldp);
 
-				/* Check new block for correctness and add it to range list */
+				/* Check new block for correctness and add it to range set */
 				if (size > 0) {
 					if(add_range(ranges, newp, size, trace, i, index) == 0)
 						return 0;
@@ -1052,14 +1597,16 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size the heap reached while running the student's malloc
+ *   package on the trace. mem_sbrk() can decrement the brk pointer, so
+ *   the final brk is not necessarily the high water mark of the heap.
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   If resident is not NULL, the resident size of the heap is sampled
+ *   RESIDENT_SAMPLES times over the trace and the average is stored there.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, size_t *resident)
 {
 	int i;
 	int index;
@@ -1068,11 +1615,16 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 	int total_size = 0;
 	char *p;
 	char *newp, *oldp;
+	int every = trace->num_ops / RESIDENT_SAMPLES + 1;
+	double resident_sum = 0;
+	int samples = 0;
 
 	reinit_trace(trace);
 
 	/* initialize the heap and the mm malloc package */
 	mem_reset_brk();
+	if (resident != NULL)
+		mem_purge_all(); /* drop the pages earlier runs left resident */
 	if (mm_init() < 0)
 		app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
 
@@ -1080,10 +1632,15 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 		switch (trace->ops[i].type) {
 
 			case ALLOC: /* mm_alloc */
+			case MEMALIGN: /* mm_memalign */
+			case CALLOC: /* mm_calloc */
 				index = trace->ops[i].index;
 				size = trace->ops[i].size;
 
-				if ((p = mm_malloc(size)) == NULL) {
+				p = trace->ops[i].type == ALLOC ? mm_malloc(size) :
+					trace->ops[i].type == CALLOC ? mm_calloc(1, size) :
+					mm_memalign(trace->ops[i].align, size);
+				if (p == NULL) {
 					app_error("trace %d: mm_malloc failed in eval_mm_util",
 							tracenum);
 				}
@@ -1136,11 +1693,18 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 		/* update the high-water mark */
 		max_total_size = (total_size > max_total_size) ?
 			total_size : max_total_size;
+
+		if (resident != NULL && i % every == every - 1) {
+			resident_sum += mem_resident();
+			samples++;
+		}
 	}
+	if (resident != NULL)
+		*resident = samples == 0 ? mem_resident() : (size_t)(resident_sum / samples);
 
 	printf(".");
 
-	return ((double)max_total_size / (double)mem_heapsize());
+	return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -1172,6 +1736,22 @@ static void eval_mm_speed(void *ptr)
 				trace->blocks[index] = p;
 				break;
 
+			case MEMALIGN: /* mm_memalign */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+					app_error("mm_memalign error in eval_mm_speed");
+				trace->blocks[index] = p;
+				break;
+
+			case CALLOC: /* mm_calloc */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if ((p = mm_calloc(1, size)) == NULL)
+					app_error("mm_calloc error in eval_mm_speed");
+				trace->blocks[index] = p;
+				break;
+
 			case REALLOC: /* mm_realloc */
 				index = trace->ops[i].index;
 				newsize = trace->ops[i].size;
@@ -1196,6 +1776,209 @@ static void eval_mm_speed(void *ptr)
 		}
 }
 
+/*
+ * run_replays - For each trace and each -T thread count, deal the
+ *     trace's ids out to the threads and replay them all at once,
+ *     against mm and, with -l, against libc malloc. Each row gives the
+ *     aggregate throughput (all requests over the wall time of the
+ *     whole replay) and the average and slowest throughput of a single
+ *     thread. The trace was already checked by eval_mm_valid, so the
+ *     replay only checks that no request fails.
+ */
+static void run_replays(int num_tracefiles, const char *tracedir,
+		char **tracefiles, int run_libc)
+{
+	static replay_t r[MAXTHREADS];
+	char counts[MAXLINE], *tok;
+	stats_t stats;
+	trace_t *trace;
+	double secs, tsecs, slowest; /* slowest is a rate, ops/sec */
+	int i, j, n, lib;
+
+	printf("Multi-threaded replay, ids split across the threads (Kops):\n");
+	printf("%8s%10s%10s%10s", "threads", "mm", "/thread", "slowest");
+	if (run_libc)
+		printf("%10s%10s%10s", "libc", "/thread", "slowest");
+	printf("  %s\n", "trace");
+	for (i = 0; i < num_tracefiles; i++) {
+		trace = read_trace(&stats, tracedir, tracefiles[i]);
+		snprintf(counts, sizeof(counts), "%s", replay_threads);
+		for (tok = strtok(counts, ","); tok != NULL; tok = strtok(NULL, ",")) {
+			n = atoi(tok);
+			if (n < 1 || n > MAXTHREADS)
+				app_error("bad thread count %s for -T", tok);
+#ifndef THREAD_SAFE
+			if (n > 1) {
+				printf("%8d  skipped: mm.c built without THREAD_SAFE  %s\n",
+						n, trace->filename);
+				continue;
+			}
+#endif
+			printf("%8d", n);
+			for (lib = 0; lib <= run_libc; lib++) {
+				for (j = 0; j < n; j++)
+					r[j].libc = lib;
+				secs = eval_replay(trace, r, n);
+				tsecs = 0;
+				slowest = DBL_MAX;
+				for (j = 0; j < n; j++) {
+					tsecs += r[j].secs;
+					if (r[j].num_ops > 0 && r[j].num_ops / r[j].secs < slowest)
+						slowest = r[j].num_ops / r[j].secs;
+				}
+				printf("%10.0f%10.0f%10.0f",
+						trace->num_ops / 1e3 / secs,
+						trace->num_ops / 1e3 / tsecs,
+						slowest / 1e3);
+			}
+			printf("  %s\n", trace->filename);
+		}
+		free_trace(trace);
+	}
+	printf("\n");
+}
+
+/*
+ * eval_replay - Replay trace on nthreads threads, REPLAY_RUNS times,
+ *     and return the wall time of the fastest run, from the earliest
+ *     start to the latest finish that the threads timed themselves.
+ *     r[i].libc picks the allocator; r[i].secs is left with thread i's
+ *     time in that run.
+ */
+static double eval_replay(trace_t *trace, replay_t *r, int nthreads)
+{
+	struct timespec *t0, *t1;
+	double secs, best = DBL_MAX, best_secs[MAXTHREADS];
+	int i, run, id;
+
+	for (i = 0; i < nthreads; i++) {
+		r[i].trace = trace;
+		r[i].num_ops = 0;
+		if ((r[i].opnums = malloc(trace->num_ops * sizeof(int))) == NULL ||
+				(r[i].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+			unix_error("malloc failed in eval_replay");
+	}
+	/* free(NULL) requests have id -1 and go to the first thread */
+	for (i = 0; i < trace->num_ops; i++) {
+		id = trace->ops[i].index < 0 ? 0 : trace->ops[i].index % nthreads;
+		r[id].opnums[r[id].num_ops++] = i;
+	}
+
+	for (run = 0; run < REPLAY_RUNS; run++) {
+		if (!r[0].libc) {
+			mem_reset_brk();
+			if (mm_init() < 0)
+				app_error("mm_init failed in eval_replay");
+		}
+		pthread_barrier_init(&replay_barrier, NULL, nthreads + 1);
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&r[i].tid, NULL, replay_thread, &r[i]) != 0)
+				unix_error("pthread_create failed in eval_replay");
+		}
+		pthread_barrier_wait(&replay_barrier);
+		/* second barrier: every thread has finished its requests */
+		pthread_barrier_wait(&replay_barrier);
+		t0 = &r[0].t0;
+		t1 = &r[0].t1;
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(r[i].tid, NULL);
+			if (r[i].t0.tv_sec < t0->tv_sec || (r[i].t0.tv_sec == t0->tv_sec &&
+						r[i].t0.tv_nsec < t0->tv_nsec))
+				t0 = &r[i].t0;
+			if (r[i].t1.tv_sec > t1->tv_sec || (r[i].t1.tv_sec == t1->tv_sec &&
+						r[i].t1.tv_nsec > t1->tv_nsec))
+				t1 = &r[i].t1;
+		}
+		pthread_barrier_destroy(&replay_barrier);
+		secs = (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+		if (secs < best) {
+			best = secs;
+			for (i = 0; i < nthreads; i++)
+				best_secs[i] = r[i].secs;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		r[i].secs = best_secs[i];
+		free(r[i].opnums);
+		free(r[i].blocks);
+	}
+	return best;
+}
+
+/*
+ * replay_thread - Run one thread's share of a -T replay. Blocks still
+ *     allocated at the end are freed after the clock stops.
+ */
+static void *replay_thread(void *ptr)
+{
+	replay_t *r = ptr;
+	traceop_t *op;
+	char *p;
+	int i;
+
+	pthread_barrier_wait(&replay_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &r->t0);
+	for (i = 0; i < r->num_ops; i++) {
+		op = &r->trace->ops[r->opnums[i]];
+		switch (op->type) {
+			case ALLOC:
+				p = r->libc ? malloc(op->size) : mm_malloc(op->size);
+				if (p == NULL)
+					app_error("malloc failed in replay_thread");
+				r->blocks[op->index] = p;
+				break;
+
+			case MEMALIGN:
+				p = r->libc ? aligned_alloc(op->align, op->size)
+					: mm_memalign(op->align, op->size);
+				if (p == NULL)
+					app_error("memalign failed in replay_thread");
+				r->blocks[op->index] = p;
+				break;
+
+			case CALLOC:
+				p = r->libc ? calloc(1, op->size) : mm_calloc(1, op->size);
+				if (p == NULL)
+					app_error("calloc failed in replay_thread");
+				r->blocks[op->index] = p;
+				break;
+
+			case REALLOC:
+				p = r->blocks[op->index];
+				p = r->libc ? realloc(p, op->size) : mm_realloc(p, op->size);
+				if (p == NULL && op->size != 0)
+					app_error("realloc failed in replay_thread");
+				r->blocks[op->index] = p;
+				break;
+
+			case FREE:
+				p = op->index < 0 ? NULL : r->blocks[op->index];
+				if (r->libc)
+					free(p);
+				else
+					mm_free(p);
+				if (op->index >= 0)
+					r->blocks[op->index] = NULL;
+				break;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &r->t1);
+	pthread_barrier_wait(&replay_barrier);
+	r->secs = (r->t1.tv_sec - r->t0.tv_sec) + (r->t1.tv_nsec - r->t0.tv_nsec) / 1e9;
+
+	for (i = 0; i < r->trace->num_ids; i++) {
+		if (r->blocks[i] == NULL)
+			continue;
+		if (r->libc)
+			free(r->blocks[i]);
+		else
+			mm_free(r->blocks[i]);
+		r->blocks[i] = NULL;
+	}
+	return NULL;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1220,6 +2003,22 @@ static int eval_libc_valid(trace_t *trace)
 				trace->blocks[trace->ops[i].index] = p;
 				break;
 
+			case MEMALIGN: /* aligned_alloc */
+				if ((p = aligned_alloc(trace->ops[i].align, trace->ops[i].size)) == NULL) {
+					malloc_error(trace, i, "libc aligned_alloc failed");
+					unix_error("System message");
+				}
+				trace->blocks[trace->ops[i].index] = p;
+				break;
+
+			case CALLOC: /* calloc */
+				if ((p = calloc(1, trace->ops[i].size)) == NULL) {
+					malloc_error(trace, i, "libc calloc failed");
+					unix_error("System message");
+				}
+				trace->blocks[trace->ops[i].index] = p;
+				break;
+
 			case REALLOC: /* realloc */
 				newsize = trace->ops[i].size;
 				oldp = trace->blocks[trace->ops[i].index];
@@ -1270,6 +2069,22 @@ static void eval_libc_speed(void *ptr)
 				trace->blocks[index] = p;
 				break;
 
+			case MEMALIGN: /* aligned_alloc */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if ((p = aligned_alloc(trace->ops[i].align, size)) == NULL)
+					unix_error("aligned_alloc failed in eval_libc_speed");
+				trace->blocks[index] = p;
+				break;
+
+			case CALLOC: /* calloc */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if ((p = calloc(1, size)) == NULL)
+					unix_error("calloc failed in eval_libc_speed");
+				trace->blocks[index] = p;
+				break;
+
 			case REALLOC: /* realloc */
 				index = trace->ops[i].index;
 				newsize = trace->ops[i].size;
@@ -1293,6 +2108,351 @@ static void eval_libc_speed(void *ptr)
 	}
 }
 
+/*
+ * run_streams - Replay each binary trace as a stream (-B), against mm
+ *     and, with -l, against libc malloc. The trace is read again for
+ *     each allocator. Only the replay of each window is timed, not the
+ *     waits for the reader. "stall" is the time spent in those waits.
+ *     "util" is the peak of the live payload bytes over the peak heap
+ *     size, as in eval_mm_util; it is left out for libc.
+ */
+static void run_streams(int num_tracefiles, const char *tracedir,
+		char **tracefiles, int run_libc)
+{
+	stream_t st;
+	tracehdr_t hdr;
+	int i, lib;
+
+	printf("Streamed replay, %d requests per window:\n", STREAM_WINDOW);
+	printf("%6s%12s%10s%10s%10s%6s  %s\n",
+			"", "ops", "secs", "Kops", "stall", "util", "trace");
+	for (i = 0; i < num_tracefiles; i++) {
+		for (lib = run_libc; lib >= 0; lib--) {
+			snprintf(st.filename, sizeof(st.filename), "%s%s",
+					tracedir, tracefiles[i]);
+			if ((st.file = fopen(st.filename, "r")) == NULL)
+				unix_error("Could not open %s in run_streams", st.filename);
+			if (fread(&hdr, sizeof(hdr), 1, st.file) != 1 ||
+					memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0)
+				app_error("%s: -B needs a binary trace (see traces/rep2bin.pl)",
+						st.filename);
+			st.varint = (hdr.flags & TRACE_VARINT) != 0;
+			st.left = hdr.num_ops;
+			st.index = 0;
+			printf("%6s", lib ? "libc" : "mm");
+			eval_stream(&st, lib);
+			fclose(st.file);
+		}
+	}
+}
+
+/*
+ * eval_stream - Replay the stream st against mm or libc malloc while a
+ *     reader thread fills the other window. Block pointers and sizes
+ *     are kept in tables indexed by id that grow as larger ids show up.
+ */
+static void eval_stream(stream_t *st, int libc)
+{
+	char **blocks = NULL, *p;
+	size_t *sizes = NULL, live = 0, peak = 0;
+	int cap = 0, newcap, w, i, n;
+	unsigned long ops = 0;
+	double secs = 0, stall = 0;
+	struct timespec t0, t1, t2;
+	traceop_t *op;
+
+	if (!libc) {
+		mem_reset_brk();
+		if (mm_init() < 0)
+			app_error("mm_init failed in eval_stream");
+	}
+	for (w = 0; w < 2; w++) {
+		if ((st->window[w] = malloc(STREAM_WINDOW * sizeof(traceop_t))) == NULL)
+			unix_error("malloc failed in eval_stream");
+		st->full[w] = 0;
+	}
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+	if (pthread_create(&st->tid, NULL, stream_reader, st) != 0)
+		unix_error("pthread_create failed in eval_stream");
+
+	for (w = 0; ; w ^= 1) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		pthread_mutex_lock(&st->lock);
+		while (!st->full[w])
+			pthread_cond_wait(&st->cond, &st->lock);
+		pthread_mutex_unlock(&st->lock);
+		if ((n = st->count[w]) == 0)
+			break;
+
+		/* check the ids and grow the tables before the clock starts */
+		for (i = 0; i < n; i++) {
+			op = &st->window[w][i];
+			if (op->type > CALLOC || op->index < (op->type == FREE ? -1 : 0) ||
+					(op->type == MEMALIGN &&
+					 (op->align == 0 || (op->align & (op->align - 1)) != 0)))
+				app_error("%s: bad request at op %lu", st->filename, ops + i);
+			if (op->index < cap)
+				continue;
+			for (newcap = cap ? cap : 1024; newcap <= op->index; newcap *= 2)
+				;
+			if ((blocks = realloc(blocks, newcap * sizeof(*blocks))) == NULL ||
+					(sizes = realloc(sizes, newcap * sizeof(*sizes))) == NULL)
+				unix_error("realloc failed in eval_stream");
+			memset(blocks + cap, 0, (newcap - cap) * sizeof(*blocks));
+			memset(sizes + cap, 0, (newcap - cap) * sizeof(*sizes));
+			cap = newcap;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (i = 0; i < n; i++) {
+			op = &st->window[w][i];
+			switch (op->type) {
+				case ALLOC:
+					p = libc ? malloc(op->size) : mm_malloc(op->size);
+					break;
+
+				case MEMALIGN:
+					p = libc ? aligned_alloc(op->align, op->size)
+						: mm_memalign(op->align, op->size);
+					break;
+
+				case CALLOC:
+					p = libc ? calloc(1, op->size) : mm_calloc(1, op->size);
+					break;
+
+				case REALLOC:
+					p = blocks[op->index];
+					p = libc ? realloc(p, op->size) : mm_realloc(p, op->size);
+					break;
+
+				default: /* FREE */
+					p = op->index < 0 ? NULL : blocks[op->index];
+					if (libc)
+						free(p);
+					else
+						mm_free(p);
+					if (op->index >= 0) {
+						live -= sizes[op->index];
+						sizes[op->index] = 0;
+						blocks[op->index] = NULL;
+					}
+					continue;
+			}
+			if (p == NULL && op->size != 0)
+				app_error("%s: request %lu failed in eval_stream",
+						st->filename, ops + i);
+			blocks[op->index] = p;
+			live += (size_t)op->size - sizes[op->index];
+			sizes[op->index] = op->size;
+			if (live > peak)
+				peak = live;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		ops += n;
+		stall += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		secs += (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+
+		/* hand the window back to the reader */
+		pthread_mutex_lock(&st->lock);
+		st->full[w] = 0;
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+	}
+	pthread_join(st->tid, NULL);
+	pthread_cond_destroy(&st->cond);
+	pthread_mutex_destroy(&st->lock);
+
+	if (libc)
+		printf("%12lu%10.3f%10.0f%10.3f%6s  %s\n", ops, secs,
+				secs == 0 ? 0 : ops / 1e3 / secs, stall, "-", st->filename);
+	else
+		printf("%12lu%10.3f%10.0f%10.3f%5.0f%%  %s\n", ops, secs,
+				secs == 0 ? 0 : ops / 1e3 / secs, stall,
+				mem_peak_heapsize() == 0 ? 0 : 100.0 * peak / mem_peak_heapsize(),
+				st->filename);
+
+	/* blocks still allocated go back untimed */
+	for (i = 0; i < cap; i++) {
+		if (blocks[i] == NULL)
+			continue;
+		if (libc)
+			free(blocks[i]);
+		else
+			mm_free(blocks[i]);
+	}
+	free(blocks);
+	free(sizes);
+	free(st->window[0]);
+	free(st->window[1]);
+}
+
+/*
+ * stream_reader - Fill the two windows of st in turn, each as soon as
+ *     the driver has replayed it, until the trace runs out. The last
+ *     window filled has a count of 0.
+ */
+static void *stream_reader(void *ptr)
+{
+	stream_t *st = ptr;
+	traceop_t *op;
+	uint32_t v;
+	int w, n, c, shift, field, nfields;
+
+	for (w = 0; ; w ^= 1) {
+		pthread_mutex_lock(&st->lock);
+		while (st->full[w])
+			pthread_cond_wait(&st->cond, &st->lock);
+		pthread_mutex_unlock(&st->lock);
+
+		n = st->left < STREAM_WINDOW ? st->left : STREAM_WINDOW;
+		if (!st->varint) {
+			if (fread(st->window[w], sizeof(traceop_t), n, st->file) != (size_t)n)
+				app_error("%s: truncated binary trace", st->filename);
+		} else {
+			for (op = st->window[w]; op < st->window[w] + n; op++) {
+				if ((c = getc_unlocked(st->file)) == EOF)
+					app_error("%s: truncated binary trace", st->filename);
+				op->type = c;
+				op->size = op->align = 0;
+				nfields = op->type == FREE ? 1 : op->type == MEMALIGN ? 3 : 2;
+				for (field = 0; field < nfields; field++) {
+					v = 0;
+					shift = 0;
+					do {
+						if ((c = getc_unlocked(st->file)) == EOF || shift > 28)
+							app_error("%s: truncated binary trace", st->filename);
+						v |= (uint32_t)(c & 0x7f) << shift;
+						shift += 7;
+					} while (c & 0x80);
+					if (field == 0) {
+						/* zigzag: even values are >= 0, odd ones negative */
+						st->index += (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+						op->index = st->index;
+					} else if (field == 1) {
+						op->size = v;
+					} else {
+						op->align = v;
+					}
+				}
+			}
+		}
+		st->left -= n;
+
+		pthread_mutex_lock(&st->lock);
+		st->count[w] = n;
+		st->full[w] = 1;
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+		if (n == 0)
+			return NULL;
+	}
+}
+
+/*
+ * lat_now - A cheap timestamp for -H: the cycle counter on x86, and
+ *     nanoseconds elsewhere
+ */
+static inline unsigned long lat_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * eval_latency - Run the trace once more, on a fresh heap, timing each
+ *     request on its own, and fill in a latency histogram per request
+ *     type. Unlike fsecs this keeps the slow requests that K-best
+ *     timing of the whole trace averages away. Blocks still allocated
+ *     at the end are freed after the last request is timed.
+ */
+static void eval_latency(trace_t *trace, int libc, latency_t *lat)
+{
+	traceop_t *op;
+	unsigned long t0, c;
+	char *p;
+	int i, b, msb;
+
+	memset(lat, 0, NUM_OPTYPES * sizeof(*lat));
+	reinit_trace(trace);
+	if (!libc) {
+		mem_reset_brk();
+		if (mm_init() < 0)
+			app_error("mm_init failed in eval_latency");
+	}
+
+	for (i = 0; i < trace->num_ops; i++) {
+		op = &trace->ops[i];
+		p = op->index < 0 ? NULL : trace->blocks[op->index];
+		t0 = lat_now();
+		switch (op->type) {
+			case ALLOC:
+				p = libc ? malloc(op->size) : mm_malloc(op->size);
+				break;
+
+			case MEMALIGN:
+				p = libc ? aligned_alloc(op->align, op->size)
+					: mm_memalign(op->align, op->size);
+				break;
+
+			case CALLOC:
+				p = libc ? calloc(1, op->size) : mm_calloc(1, op->size);
+				break;
+
+			case REALLOC:
+				p = libc ? realloc(p, op->size) : mm_realloc(p, op->size);
+				break;
+
+			case FREE:
+				if (libc)
+					free(p);
+				else
+					mm_free(p);
+				break;
+		}
+		c = lat_now() - t0;
+
+		if (op->type != FREE) {
+			if (p == NULL && op->size != 0)
+				app_error("request %d failed in eval_latency", i);
+			trace->blocks[op->index] = p;
+		} else if (op->index >= 0)
+			trace->blocks[op->index] = NULL;
+
+		/* LAT_SUB buckets per power of two, exact below LAT_SUB */
+		if (c < LAT_SUB) {
+			b = c;
+		} else {
+			msb = 63 - __builtin_clzl(c);
+			b = (msb - LAT_SUB_BITS + 1) * LAT_SUB +
+				((c >> (msb - LAT_SUB_BITS)) & (LAT_SUB - 1));
+		}
+		lat[op->type].count[b]++;
+		lat[op->type].n++;
+		if (c > lat[op->type].max) {
+			lat[op->type].max = c;
+			lat[op->type].max_op = i;
+		}
+	}
+
+	/* blocks still allocated go back untimed */
+	for (i = 0; i < trace->num_ids; i++) {
+		if (trace->blocks[i] == NULL)
+			continue;
+		if (libc)
+			free(trace->blocks[i]);
+		else
+			mm_free(trace->blocks[i]);
+		trace->blocks[i] = NULL;
+	}
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -1358,6 +2518,188 @@ static void printresults(int n, stats_t *stats)
 				"-");
 	}
 
+	if (print_latency)
+		printlatency(n, stats);
+}
+
+/*
+ * lat_percentile - The latency that a fraction q of the timed requests
+ *     did not exceed, rounded up to the top of its bucket
+ */
+static unsigned long lat_percentile(const latency_t *lat, double q)
+{
+	unsigned long need = q * lat->n, seen = 0, top;
+	int b, e;
+
+	if (need < q * lat->n || need == 0)
+		need++;
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		seen += lat->count[b];
+		if (seen >= need)
+			break;
+	}
+	if (b < LAT_SUB) {
+		top = b;
+	} else {
+		e = b / LAT_SUB - 1;
+		top = ((unsigned long)(LAT_SUB + b % LAT_SUB) << e) + (1UL << e) - 1;
+	}
+	return top < lat->max ? top : lat->max;
+}
+
+/*
+ * printlatency - prints the latency percentiles of each request type
+ *     in each valid trace (-H only). "at" is the opnum of the slowest
+ *     request of that type.
+ */
+static void printlatency(int n, stats_t *stats)
+{
+	static const char *names[NUM_OPTYPES] = {
+		"malloc", "free", "realloc", "memalign", "calloc"
+	};
+	const latency_t *lat;
+	int i, t;
+
+	printf("\nLatency per request in cycles:\n");
+	printf("  %-9s%8s%10s%10s%10s%12s%8s  %s\n",
+			"request", "n", "p50", "p99", "p99.9", "max", "at", "trace");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid)
+			continue;
+		for (t = 0; t < NUM_OPTYPES; t++) {
+			lat = &stats[i].lat[t];
+			if (lat->n == 0)
+				continue;
+			printf("  %-9s%8lu%10lu%10lu%10lu%12lu%8d  %s\n",
+					names[t],
+					lat->n,
+					lat_percentile(lat, 0.5),
+					lat_percentile(lat, 0.99),
+					lat_percentile(lat, 0.999),
+					lat->max,
+					lat->max_op,
+					stats[i].filename);
+		}
+	}
+}
+
+/*
+ * printmmstats - prints the per-trace counters reported by mm_getstats.
+ *     The last line is the worst case over all traces, i.e. a bound on
+ *     the work done by a single fit search. "copies" counts reallocs
+ *     that moved their block, "avoided" those served from growth slack,
+ *     "extends" the number of times the heap grew, "trims" the number of
+ *     times it shrank and "trim(KB)" the memory those trims gave back.
+ *     "maps" counts blocks given a mapping of their own and "remaps" the
+ *     reallocs that resized one in place of a copy. "segs" is the most
+ *     heap segments one arena needed; it exceeds 1 only when the heap
+ *     outgrew MAX_HEAP.
+ */
+static void printmmstats(int n, stats_t *stats)
+{
+	int i;
+	unsigned long max_steps = 0;
+	unsigned long max_bins = 0;
+
+	printf("  %9s%10s%10s%9s%8s%8s%8s%7s%9s%6s%7s%5s  %s\n",
+			"searches", "avg-steps", "max-steps", "max-bins",
+			"copies", "avoided", "extends", "trims", "trim(KB)",
+			"maps", "remaps", "segs", "trace");
+	for (i=0; i < n; i++) {
+		if (!stats[i].valid) {
+			printf("  %9s%10s%10s%9s%8s%8s%8s%7s%9s%6s%7s%5s  %s\n",
+					"-", "-", "-", "-", "-", "-", "-", "-", "-", "-", "-", "-",
+					stats[i].filename);
+			continue;
+		}
+		printf("  %9lu%10.2f%10lu%9lu%8lu%8lu%8lu%7lu%9lu%6lu%7lu%5lu  %s\n",
+				stats[i].mm.searches,
+				stats[i].mm.searches == 0 ? 0.0 :
+				(double)stats[i].mm.search_steps / stats[i].mm.searches,
+				stats[i].mm.max_steps,
+				stats[i].mm.max_bins,
+				stats[i].mm.realloc_copies,
+				stats[i].mm.slack_hits,
+				stats[i].mm.heap_extends,
+				stats[i].mm.heap_trims,
+				stats[i].mm.trimmed / 1024,
+				stats[i].mm.huge_maps,
+				stats[i].mm.huge_remaps,
+				stats[i].mm.segments,
+				stats[i].filename);
+		if (stats[i].mm.max_steps > max_steps)
+			max_steps = stats[i].mm.max_steps;
+		if (stats[i].mm.max_bins > max_bins)
+			max_bins = stats[i].mm.max_bins;
+	}
+	printf("Worst case per search: %lu free blocks, %lu size classes\n",
+			max_steps, max_bins);
+}
+
+/*
+ * printquickstats - prints, for each trace, the coalesce and split
+ *     operations done with quick lists and with coalescing on every
+ *     free ("eager"), and how many of them the quick lists saved.
+ */
+static void printquickstats(int n, stats_t *stats)
+{
+	int i;
+	long saved, total_saved = 0;
+
+	printf("  %10s%10s%10s%10s%10s%10s  %s\n",
+			"quick-hits", "coalesces", "eager", "splits", "eager",
+			"saved", "trace");
+	for (i=0; i < n; i++) {
+		if (!stats[i].valid) {
+			printf("  %10s%10s%10s%10s%10s%10s  %s\n",
+					"-", "-", "-", "-", "-", "-", stats[i].filename);
+			continue;
+		}
+		saved = (long)(stats[i].mm_eager.coalesces + stats[i].mm_eager.splits) -
+			(long)(stats[i].mm.coalesces + stats[i].mm.splits);
+		total_saved += saved;
+		printf("  %10lu%10lu%10lu%10lu%10lu%10ld  %s\n",
+				stats[i].mm.quick_hits,
+				stats[i].mm.coalesces,
+				stats[i].mm_eager.coalesces,
+				stats[i].mm.splits,
+				stats[i].mm_eager.splits,
+				saved,
+				stats[i].filename);
+	}
+	printf("Coalesce and split operations saved: %ld\n", total_saved);
+}
+
+/*
+ * printpurgestats - prints, for each trace, how often free pages were
+ *     purged, and the average resident size of the heap with purging on
+ *     and off ("kept"). "saved" is the difference.
+ */
+static void printpurgestats(int n, stats_t *stats)
+{
+	int i;
+	long saved, total_saved = 0;
+
+	printf("  %8s%11s%13s%10s%10s  %s\n",
+			"purges", "purged(KB)", "resident(KB)", "kept(KB)", "saved(KB)",
+			"trace");
+	for (i=0; i < n; i++) {
+		if (!stats[i].valid) {
+			printf("  %8s%11s%13s%10s%10s  %s\n",
+					"-", "-", "-", "-", "-", stats[i].filename);
+			continue;
+		}
+		saved = ((long)stats[i].resident_kept - (long)stats[i].resident) / 1024;
+		total_saved += saved;
+		printf("  %8lu%11lu%13lu%10lu%10ld  %s\n",
+				stats[i].mm.purges,
+				stats[i].mm.purged / 1024,
+				(unsigned long)stats[i].resident / 1024,
+				(unsigned long)stats[i].resident_kept / 1024,
+				saved,
+				stats[i].filename);
+	}
+	printf("Average resident memory saved: %ld KB\n", total_saved);
 }
 
 /*
@@ -1405,7 +2747,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-	fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+	fprintf(stderr, "Usage: mdriver [-hlVdDBHS] [-g <min,max,window[,trim,pad[,decay[,map]]]>] [-T <n1,n2,...>] [-f <file>]\n");
 	fprintf(stderr, "Options\n");
 	fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
 	fprintf(stderr, "\t-D         Equivalent to -d2.\n");
@@ -1418,4 +2760,9 @@ static void usage(void)
 	fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
 	fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
 	fprintf(stderr, "\t-j         Use <stdin> as the trace file.\n");
+	fprintf(stderr, "\t-S         Print allocator statistics for each trace.\n");
+	fprintf(stderr, "\t-B         Stream binary traces in windows, for traces too big to load.\n");
+	fprintf(stderr, "\t-H         Time every request, print latency percentiles.\n");
+	fprintf(stderr, "\t-T <list>  Also replay each trace split across n1,n2,... threads.\n");
+	fprintf(stderr, "\t-g <min,max,window[,trim,pad[,decay[,map]]]>  Heap growth, trim, purge and mmap policy (see mm_params_t).\n");
 }
\ No newline at end of file
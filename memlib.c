@@ -3,6 +3,7 @@
  *						allows us to interleave calls from the student's malloc package 
  *						with the system's malloc package in libc.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -20,6 +21,45 @@ static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
 
+/*
+ * Extra regions handed out by mem_region_new. Region 0 is the heap
+ * above; each extra region is a separate MAX_HEAP mapping with its own
+ * brk, so allocators can keep one independent heap per arena.
+ */
+static char *region_lo[MAX_REGIONS];
+static char *region_brk[MAX_REGIONS];
+static int num_regions = 1;
+
+/*
+ * Highest brk of each region (0 is the heap) since it was mapped or
+ * last purged. Nothing at or above it has been handed out, so it still
+ * reads as zeros.
+ */
+static char *region_fresh[MAX_REGIONS];
+
+/*
+ * Mappings handed out by mem_map for blocks that do not live in any
+ * region. The table itself is mmapped, so that memlib never calls the
+ * libc malloc that the driver is comparing against. It is kept sorted
+ * by descending address so that lookups are binary searches; mmap
+ * hands out addresses from the top down, so a new mapping usually
+ * goes at the end.
+ */
+typedef struct {
+	char *addr;
+	size_t len;
+} mapping_t;
+
+static mapping_t *maps;
+static int num_maps, max_maps;
+
+/*
+ * Bytes in use over all regions and mappings, and the largest value
+ * since the last reset. Regions grow concurrently, so both are updated
+ * atomically.
+ */
+static size_t mem_total, mem_total_peak;
+
 /* 
  * mem_init - initialize the memory system model
  */
@@ -28,44 +68,314 @@ void mem_init(void){
 	heap = mmap((void *)0x800000000, /* suggested start*/
 			MAX_HEAP,				/* length */
 			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
+			MAP_PRIVATE | MAP_NORESERVE,	/* private or shared? */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
+	region_fresh[0] = heap;
+}
+
+/*
+ * account - add incr bytes to the total in use and raise the peak
+ */
+static void account(long incr){
+	size_t total = __atomic_add_fetch(&mem_total, incr, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&mem_total_peak, __ATOMIC_RELAXED);
+
+	while (total > peak &&
+			!__atomic_compare_exchange_n(&mem_total_peak, &peak, total, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
 }
 
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
+	int i;
+
+	mem_reset_brk();
 	munmap(heap, MAX_HEAP);
+	for (i = 1; i < num_regions; i++)
+		munmap(region_lo[i], MAX_HEAP);
+	num_regions = 1;
+	if (maps != NULL)
+		munmap(maps, max_maps * sizeof(mapping_t));
+	maps = NULL;
+	max_maps = 0;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *		and unmap every mapping that is still live
  */
 void mem_reset_brk(){
+	int i;
+
 	mem_brk = heap;
+	for (i = 1; i < num_regions; i++)
+		region_brk[i] = region_lo[i];
+	for (i = 0; i < num_maps; i++)
+		munmap(maps[i].addr, maps[i].len);
+	num_maps = 0;
+	mem_total = mem_total_peak = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		by incr bytes and returns the start address of the new area.
+ *		A negative incr shrinks the heap, but never below its start;
+ *		the old brk is returned as usual.
  */
-void *mem_sbrk(int incr) {
+void *mem_sbrk(intptr_t incr) {
 	char *old_brk = mem_brk;
 
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+	if ((mem_brk + incr) < heap) {
+		errno = EINVAL;
+		fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap start...\n");
+		return (void *)-1;
+	}
+	if ((mem_brk + incr) > mem_max_addr) {
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 		return (void *)-1;
 	}
 	mem_brk += incr;
+	if (mem_brk > region_fresh[0])
+		region_fresh[0] = mem_brk;
+	account(incr);
+	return (void *)old_brk;
+}
+
+/*
+ * mem_region_new - map a new, empty region and return its id (>= 1),
+ *		or -1 if there are already MAX_REGIONS regions or mmap fails.
+ *		Callers must serialize calls to mem_region_new; each region can
+ *		then be grown independently of the others.
+ */
+int mem_region_new(void){
+	char *lo;
+
+	if (num_regions >= MAX_REGIONS)
+		return -1;
+	lo = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (lo == MAP_FAILED)
+		return -1;
+	region_lo[num_regions] = lo;
+	region_brk[num_regions] = lo;
+	region_fresh[num_regions] = lo;
+	return num_regions++;
+}
+
+/*
+ * mem_region_sbrk - mem_sbrk for region (0 is the heap itself)
+ */
+void *mem_region_sbrk(int region, intptr_t incr){
+	char *old_brk;
+
+	if (region == 0)
+		return mem_sbrk(incr);
+	old_brk = region_brk[region];
+	if ((old_brk + incr) < region_lo[region]) {
+		errno = EINVAL;
+		fprintf(stderr, "ERROR: mem_region_sbrk failed. Shrunk below the region start...\n");
+		return (void *)-1;
+	}
+	if ((old_brk + incr) > region_lo[region] + MAX_HEAP) {
+		errno = ENOMEM;
+		fprintf(stderr, "ERROR: mem_region_sbrk failed. Ran out of memory...\n");
+		return (void *)-1;
+	}
+	region_brk[region] += incr;
+	if (region_brk[region] > region_fresh[region])
+		region_fresh[region] = region_brk[region];
+	account(incr);
 	return (void *)old_brk;
 }
 
+/*
+ * mem_region_lo - return the first address of region; the region spans
+ *		MAX_HEAP bytes from there
+ */
+void *mem_region_lo(int region){
+	return region == 0 ? (void *)heap : (void *)region_lo[region];
+}
+
+/*
+ * mem_region_fresh - return the address from which region still reads
+ *		as zeros: memory at or above it has never been below brk since
+ *		the region was mapped or last purged. mem_reset_brk does not
+ *		lower it, since the pages below keep what earlier runs wrote.
+ */
+void *mem_region_fresh(int region){
+	return region_fresh[region];
+}
+
+/*
+ * mem_region_size - every region, the heap included, spans this many bytes
+ */
+size_t mem_region_size(void){
+	return MAX_HEAP;
+}
+
+/*
+ * below_map - index of the first mapping that starts at or below addr,
+ *		or num_maps if there is none
+ */
+static int below_map(const char *addr){
+	int lo = 0, hi = num_maps, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (maps[mid].addr > addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * insert_map - add the mapping [addr, addr + len) to the table, which
+ *		must have room for it
+ */
+static void insert_map(char *addr, size_t len){
+	int i = below_map(addr);
+
+	memmove(&maps[i + 1], &maps[i], (num_maps - i) * sizeof(mapping_t));
+	maps[i].addr = addr;
+	maps[i].len = len;
+	num_maps++;
+}
+
+/*
+ * remove_map - drop entry i from the table
+ */
+static void remove_map(int i){
+	num_maps--;
+	memmove(&maps[i], &maps[i + 1], (num_maps - i) * sizeof(mapping_t));
+}
+
+/*
+ * mem_map - map len bytes of fresh, zeroed memory outside every region
+ *		and return its start, or NULL if mmap fails. len is rounded up
+ *		to whole pages. Like mem_region_new, calls to mem_map, mem_unmap
+ *		and mem_remap must be serialized by the caller.
+ */
+void *mem_map(size_t len){
+	mapping_t *grown;
+	size_t page = mem_pagesize();
+	char *addr;
+	int max;
+
+	len = (len + page - 1) & ~(page - 1);
+	if (num_maps == max_maps) {
+		max = max_maps ? 2 * max_maps : (int)(page / sizeof(mapping_t));
+		grown = mmap(NULL, max * sizeof(mapping_t), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (grown == MAP_FAILED)
+			return NULL;
+		if (maps != NULL) {
+			memcpy(grown, maps, num_maps * sizeof(mapping_t));
+			munmap(maps, max_maps * sizeof(mapping_t));
+		}
+		maps = grown;
+		max_maps = max;
+	}
+	addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+	insert_map(addr, len);
+	account(len);
+	return addr;
+}
+
+/*
+ * find_map - index of the mapping that starts at addr, or -1
+ */
+static int find_map(void *addr){
+	int i = below_map(addr);
+
+	return (i < num_maps && maps[i].addr == addr) ? i : -1;
+}
+
+/*
+ * mem_unmap - unmap a mapping returned by mem_map or mem_remap. Returns
+ *		0 on success, -1 if addr does not start a live mapping.
+ */
+int mem_unmap(void *addr){
+	int i = find_map(addr);
+
+	if (i < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	munmap(maps[i].addr, maps[i].len);
+	account(-(long)maps[i].len);
+	remove_map(i);
+	return 0;
+}
+
+/*
+ * mem_remap - resize the mapping at addr to newlen bytes and return its
+ *		new start, or NULL (leaving the old mapping alone) on failure.
+ *		mremap may move the mapping, but it moves the pages rather than
+ *		copying them, so growing a mapping costs the same at any size.
+ */
+void *mem_remap(void *addr, size_t newlen){
+	size_t page = mem_pagesize();
+	char *moved;
+	int i = find_map(addr);
+
+	if (i < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	newlen = (newlen + page - 1) & ~(page - 1);
+	if (newlen == maps[i].len)
+		return addr;
+#ifdef MREMAP_MAYMOVE
+	moved = mremap(addr, maps[i].len, newlen, MREMAP_MAYMOVE);
+	if (moved == MAP_FAILED)
+		return NULL;
+#else
+	moved = mmap(NULL, newlen, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (moved == MAP_FAILED)
+		return NULL;
+	memcpy(moved, addr, newlen < maps[i].len ? newlen : maps[i].len);
+	munmap(addr, maps[i].len);
+#endif
+	account((long)newlen - (long)maps[i].len);
+	if (moved == addr)
+		maps[i].len = newlen;
+	else {
+		remove_map(i);
+		insert_map(moved, newlen);
+	}
+	return moved;
+}
+
+/*
+ * mem_in_heap - does [lo, hi] lie inside one region, below its brk, or
+ *		inside one live mapping?
+ */
+int mem_in_heap(void *lo, void *hi){
+	char *l = lo, *h = hi;
+	int i;
+
+	if (l >= heap && h < mem_brk)
+		return 1;
+	for (i = 1; i < num_regions; i++)
+		if (l >= region_lo[i] && h < region_brk[i])
+			return 1;
+	i = below_map(l);
+	return i < num_maps && h < maps[i].addr + maps[i].len;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,10 +391,19 @@ void *mem_heap_hi(){
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, counting every
+ *		region and every live mapping
  */
 size_t mem_heapsize() {
-	return (size_t)((void *)mem_brk - (void *)heap);
+	return __atomic_load_n(&mem_total, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size, in bytes, since
+ *		the last mem_reset_brk
+ */
+size_t mem_peak_heapsize() {
+	return __atomic_load_n(&mem_total_peak, __ATOMIC_RELAXED);
 }
 
 /*
@@ -93,3 +412,70 @@ size_t mem_heapsize() {
 size_t mem_pagesize(){
 	return (size_t)getpagesize();
 }
+
+/*
+ * mem_purge - give the pages in [addr, addr + len) back to the system.
+ *		Both ends must be page aligned. The range stays mapped and reads
+ *		back as zeros. MADV_DONTNEED drops the pages at once, so the
+ *		saving shows up in mem_resident right away. Returns 0 on
+ *		success, -1 on error.
+ */
+int mem_purge(void *addr, size_t len){
+	if (len == 0)
+		return 0;
+	return madvise(addr, len, MADV_DONTNEED);
+}
+
+/*
+ * mem_purge_all - purge the heap and every region, including the part
+ *		above brk, so that a new run starts with no resident pages
+ */
+void mem_purge_all(void){
+	int i;
+
+	mem_purge(heap, MAX_HEAP);
+	region_fresh[0] = mem_brk;
+	for (i = 1; i < num_regions; i++) {
+		mem_purge(region_lo[i], MAX_HEAP);
+		region_fresh[i] = region_brk[i];
+	}
+}
+
+/*
+ * resident - bytes of [lo, hi) that are resident, counted page by page
+ */
+static size_t resident(char *lo, char *hi){
+	unsigned char vec[1024];
+	size_t page = mem_pagesize();
+	size_t size = 0, len, n, i;
+
+	hi = (char *)(((unsigned long)hi + page - 1) & ~(page - 1));
+	while (lo < hi) {
+		len = (size_t)(hi - lo);
+		if (len > sizeof(vec) * page)
+			len = sizeof(vec) * page;
+		n = len / page;
+		if (mincore(lo, len, vec) < 0)
+			return size;
+		for (i = 0; i < n; i++)
+			if (vec[i] & 1)
+				size += page;
+		lo += len;
+	}
+	return size;
+}
+
+/*
+ * mem_resident - bytes of the heap and all regions, up to brk, and of
+ *		all mappings that are resident in memory
+ */
+size_t mem_resident(void){
+	size_t size = resident(heap, mem_brk);
+	int i;
+
+	for (i = 1; i < num_regions; i++)
+		size += resident(region_lo[i], region_brk[i]);
+	for (i = 0; i < num_maps; i++)
+		size += resident(maps[i].addr, maps[i].addr + maps[i].len);
+	return size;
+}
@@ -1,11 +1,34 @@
+#include <stdint.h>
 #include <unistd.h>
 
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
+
+/* Independent regions, e.g. one per allocator arena or heap segment;
+   region 0 is the heap */
+#define MAX_REGIONS 64
+int mem_region_new(void);
+void *mem_region_sbrk(int region, intptr_t incr);
+void *mem_region_lo(int region);
+void *mem_region_fresh(int region);
+size_t mem_region_size(void);
+
+/* Mappings outside every region, e.g. for huge blocks */
+void *mem_map(size_t len);
+int mem_unmap(void *addr);
+void *mem_remap(void *addr, size_t newlen);
+int mem_in_heap(void *lo, void *hi);
+
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
 
+/* Give whole pages back to the system and measure what is still resident */
+int mem_purge(void *addr, size_t len);
+void mem_purge_all(void);
+size_t mem_resident(void);
+
@@ -1,11 +1,23 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#endif
+#ifdef PERCPU
+#if !defined(__linux__) || !defined(__x86_64__)
+#error "PERCPU needs rseq, which is only implemented for Linux on x86-64"
+#endif
+#include <limits.h>
+#include <sys/rseq.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 #define DEBUG
 #ifdef DEBUG
@@ -22,24 +34,57 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
 #endif /* def DRIVER */
 
-/* single word (4) or double word (8) alignment */
+/* single word (4) or double word (8) alignment; -DALIGN16 gives 16, like glibc on x86-64 */
+#ifdef ALIGN16
+#define ALIGNMENT 16
+#else
 #define ALIGNMENT 8
+#endif
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
 #define SIZE_PTR(p)  ((size_t*)(((char*)(p)) - SIZE_T_SIZE))
 
+#ifdef HEAP64
+//64 位布局: 头部、尾部和空闲链表的偏移都是 8 字节，块大小按 16 字节取整，
+//单个块和整个堆都可以超过 4 GB。默认的 32 位布局每个块省 8 字节，适合小堆。
+typedef unsigned long word_t;
+#define WSIZE 8
+#define DSIZE 16
+#define MINBLOCKSIZE 32
+#else
+typedef unsigned int word_t;
 #define WSIZE 4 /* Word and header/footer size (bytes) */
 #define DSIZE 8 /* Double word size (bytes) */
-#define BSIZE 16
 #define MINBLOCKSIZE 16
+#endif
+//块大小的粒度。第一个载荷在 region 开头之后 16 字节，块大小都是 GRAIN 的倍数，载荷就都按 GRAIN 对齐。
+//ALIGN16 只把粒度加大到 16，头部还是 4 字节，最小块还是 16 字节: 头部放在 16 字节边界前面的那个字里
+#if defined(ALIGN16) && !defined(HEAP64)
+#define GRAIN 16
+#else
+#define GRAIN DSIZE
+#endif
+#define BSIZE 16
 #define CHUNKSIZE (1<<10) /* Extend heap by this amount (bytes) */
+//堆扩展策略的默认参数，见 mm_set_params
+#define GROW_MIN CHUNKSIZE
+#define GROW_MAX (16 * CHUNKSIZE)
+#define GROW_WINDOW 4
+#define TRIM_THRESHOLD (128 * CHUNKSIZE)
+#define TOP_PAD GROW_MAX
+#define GROW_SHARE 32 //多扩展的部分不超过 arena 堆大小的 1/GROW_SHARE，小堆不会被撑大
+#define PURGE_DECAY 1024
+#define MMAP_THRESHOLD (128 * CHUNKSIZE)
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))
 #define MIN(x, y) ((x) < (y)? (x) : (y))
@@ -48,13 +93,16 @@
 #define PACK(size, prealloc,alloc) ((size) | (PREALLOC(prealloc)) | (alloc))
 
 /* Read and write a word at address p */
-#define GET(p) (*(unsigned int *)(p))
-#define PUT(p, val) (*(unsigned int *)(p) = (val))
+#define GET(p) (*(word_t *)(p))
+#define PUT(p, val) (*(word_t *)(p) = (val))
 
 /* Read the size and allocated fields from address p */
-#define GET_SIZE(p) (GET(p) & ~0x7)
+#define GET_SIZE(p) ((size_t)(GET(p) & ~0x7))
 #define GET_ALLOC(p) (GET(p) & 0x1)
 #define GET_PREALLOC(p) (GET(p) & 0x2)
+//被 realloc 增长过的已分配块在头部第 2 位打标记，重写头部时要保留
+#define GROWN 0x4
+#define GET_GROWN(p) (GET(p) & GROWN)
 
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp) ((char *)(bp) - WSIZE)
@@ -72,30 +120,305 @@
 #define SET_NEXT(p, val) (*((unsigned int *)(p)+1) = (val))
 */
 
-#define READ(p)       (*(unsigned int *)(p))
-#define WRITE(p, val) (*(unsigned int *)(p) = (val))
+#define READ(p)       (*(word_t *)(p))
+#define WRITE(p, val) (*(word_t *)(p) = (val))
 
-#define GET_PREV(bp) (READ((char *)(bp))         == 0? NULL : (int *)((long)(READ((char *)(bp)))         + (long)(heap_listp)))
-#define GET_NEXT(bp) (READ((char *)(bp) + WSIZE) == 0? NULL : (int *)((long)(READ((char *)(bp) + WSIZE)) + (long)(heap_listp)))
-#define SET_PREV(bp, val) WRITE((char *)(bp),         (val) == 0? 0 : ((long)val - (long)(heap_listp)))
-#define SET_NEXT(bp, val) WRITE((char *)(bp) + WSIZE, (val) == 0? 0 : ((long)val - (long)(heap_listp)))
+//链表指针存的是句柄（见 to_handle），0 表示 NULL
+#define GET_PREV(bp) (READ((char *)(bp))         == 0? NULL : (int *)from_handle(READ((char *)(bp))))
+#define GET_NEXT(bp) (READ((char *)(bp) + WSIZE) == 0? NULL : (int *)from_handle(READ((char *)(bp) + WSIZE)))
+#define SET_PREV(bp, val) WRITE((char *)(bp),         (val) == 0? 0 : to_handle(val))
+#define SET_NEXT(bp, val) WRITE((char *)(bp) + WSIZE, (val) == 0? 0 : to_handle(val))
+
+/* Block size needed for a payload of size bytes (header only, no footer) */
+#define ADJUST_SIZE(size) MAX(MINBLOCKSIZE, GRAIN * (((size) + WSIZE + GRAIN - 1) / GRAIN))
 
 //remove the footer of the allocated block:
 #define PREALLOC(x) ((!x) ? 0 : 2)
 
+//再次增长需要搬家的块按 1.5 倍分配，多出的部分记在 slack 表里，供之后原地增长
+#define REALLOC_GROWTH(asize) (GRAIN * (((asize) + (asize) / 2 + GRAIN - 1) / GRAIN))
+#define SLACK_SLOTS 16
+
+//含有整页的空闲块按变成空闲的先后串在 dirty 链表上，空闲满 purge_decay 次操作后
+//把中间的整页交给 mem_purge，开头的头部、链表指针和结尾的尾部所在的页不动。
+//空闲块头部的第 2 位表示它在 dirty 链表上（已分配块的这一位是 GROWN）。
+#define DIRTY GROWN
+//dirty 链表的前驱、后继（句柄，0 表示没有）和进链表时的 arena->ops，
+//放在空闲链表指针后面，purge 从 DIRTY_END 之后的整页开始
+#define DIRTY_PREV(bp) (*(word_t *)((char *)(bp) + DSIZE))
+#define DIRTY_NEXT(bp) (*(word_t *)((char *)(bp) + DSIZE + WSIZE))
+#define DIRTY_STAMP(bp) (*(unsigned long *)((char *)(bp) + 2 * DSIZE))
+#define DIRTY_END (3 * DSIZE)
+
+//超过 mmap_threshold 的请求单独映射一块，不进任何 arena 的堆，释放时整块还给系统。
+//映射开头的 HUGE_HDR 字节记着映射的长度，载荷紧跟在后面。
+//块不在任何 arena 的 region 里，free 和 realloc 按地址（arena_of 返回 NULL）认出它。
+#define HUGE_HDR (2 * DSIZE)
+#define HUGE_LEN(bp) (*(size_t *)((char *)(bp) - HUGE_HDR))
+
+//一个 arena 的堆由最多 MAX_SEGMENTS 个段组成，每段是一个 memlib region，地址互不相邻。
+//空闲链表、dirty 链表和 slab 页链表里存的是句柄: 高位是段号，低位是段内偏移。
+#define MAX_SEGMENTS 32
+#ifdef HEAP64
+#define SEG_SHIFT 48
+#else
+#define SEG_SHIFT 27
+#endif
+#define SEG_MASK (((word_t)1 << SEG_SHIFT) - 1)
+#if MAX_HEAP > (1UL << SEG_SHIFT)
+#error "MAX_HEAP does not fit in the in-segment offset of a handle"
+#endif
+
 //Use some strange mathod to change the strategy: 选取前 FIRST_FIT_NUM 个空闲块中最小的一个:
 #define FIRST_FIT_NUM 7
 
+#ifdef TLSF
+//Two-level segregated fit: 第一级按最高位分类，第二级把每个 2 的幂区间再等分成 SL_COUNT 份。
+//小于 TLSF_SMALL 的块每 8 字节一个 bin。查找时两级 bitmap 各做一次 ctz，不遍历链表。
+#define SL_LOG 4
+#define SL_COUNT (1 << SL_LOG)
+#define TLSF_SMALL (SL_COUNT * DSIZE)
+#ifdef HEAP64
+#define FL_SHIFT 8 /* log2(TLSF_SMALL) */
+#define FL_COUNT (48 - FL_SHIFT + 1) //块不会超过 48 位的用户地址空间
+#else
+#define FL_SHIFT 7 /* log2(TLSF_SMALL) */
+#define FL_COUNT (32 - FL_SHIFT + 1)
+#endif
+#define NUM_CLASSES (FL_COUNT * SL_COUNT)
+#else
+//Segregated free lists:
+//块大小 <= SMALL_MAX 的每 8 字节一个类（类内的块大小都相同），更大的块按 2 的幂分类。
+//free_bitmap 的第 i 位表示第 i 个类的链表非空，查找时用 ctz 直接跳到第一个可用的类。
+//大小 >= TREE_MIN 的块不进链表，放进按 (size, address) 排序的 treap 里做 best fit。
+#define SMALL_MAX 128
+#define TREE_MIN 1024
+#define NUM_SMALL_CLASSES ((SMALL_MAX - MINBLOCKSIZE) / GRAIN + 1)
+#define NUM_CLASSES (NUM_SMALL_CLASSES + 3)
+
+//树节点的左右孩子存在 prev/next 的位置，同样是句柄
+#define GET_LEFT(bp) GET_PREV(bp)
+#define GET_RIGHT(bp) GET_NEXT(bp)
+#define SET_LEFT(bp, val) SET_PREV(bp, val)
+#define SET_RIGHT(bp, val) SET_NEXT(bp, val)
+#endif
+
+//BiBOP: 载荷 <= SLAB_MAX 字节、而且按 8 字节取整比加上头部的块小的请求放进 slab 页。
+//一页 SLAB_PAGE 字节（本身是堆里一个按页对齐的已分配块），只放一种大小的对象，
+//页头有分配 bitmap；对象没有头部，按地址找到页头就知道大小。
+//再大的对象一页放不下几个，页头和页尾的浪费比省下的头部还多。
+//一类请求累计 SLAB_DEMAND 次之后才开始建页，零星的几个小块不值得占一页。
+#define SLAB_PAGE 256
+#define SLAB_MAX 24
+#define SLAB_DEMAND 128
+//对象按 ALIGNMENT 取整分类，64 位布局下比块大小的粒度 GRAIN 细
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+#define SLAB_CLASS(size) ((size) / ALIGNMENT - 1)
+#define SLAB_WORDS ((SLAB_PAGE / ALIGNMENT + 63) / 64)
+#define SLAB_MAP_WORDS (MAX_HEAP / SLAB_PAGE / 64)
+#define SLAB_OF(p) ((slab_t *)((unsigned long)(p) & ~(unsigned long)(SLAB_PAGE - 1)))
+
+//延迟合并: 释放的小块先留在按大小分类的 quick list 里（仍然标记为已分配），
+//同样大小的请求直接拿走，省掉一次合并和之后的一次分割。
+//quick list 里的块超过 QUICK_LIMIT 个，或者找不到合适的空闲块时，一次全部真正释放。
+#define QUICK_MAX 256
+#define QUICK_CLASSES ((QUICK_MAX - MINBLOCKSIZE) / GRAIN + 1)
+#define QUICK_LIMIT 16
+
+#ifdef THREAD_SAFE
+//线程安全版本: 每个线程缓存最近释放的小块（块仍标记为已分配），按块大小分类，
+//用载荷的前 8 字节串成单链表。快速路径只访问线程私有的数据，不加锁；
+//缓存空了一次从中心堆拿 TCACHE_BATCH 个，满了一次还回去一半，都只加一次锁。
+#define TCACHE_MAX 256
+#define TCACHE_CLASSES ((TCACHE_MAX - MINBLOCKSIZE) / GRAIN + 1)
+#define TCACHE_BATCH 8
+#define TCACHE_LIMIT 32
+#define LOCK() pthread_mutex_lock(&arena->lock)
+#define UNLOCK() pthread_mutex_unlock(&arena->lock)
+//arena 的个数，线程按负载分到各个 arena
+#ifndef NARENAS
+#define NARENAS 8
+#endif
+#else
+#ifdef PERCPU
+#error "PERCPU requires THREAD_SAFE"
+#endif
+#define LOCK()
+#define UNLOCK()
+#undef NARENAS
+#define NARENAS 1
+#endif
+
 #ifdef NEXT_FIT
 static char *recover;
 #endif
 
+static int quick_on = 1; //mm_set_quick_lists 关掉时每次释放都立即合并
+static mm_params_t params = { GROW_MIN, GROW_MAX, GROW_WINDOW, TRIM_THRESHOLD, TOP_PAD, PURGE_DECAY, MMAP_THRESHOLD };
+static size_t page_size; //mem_pagesize()，mm_init 时取一次
+
+
+//预留了增长空间的块: 块大小 > used，[used, size) 是预留的
+typedef struct {
+    void *bp;
+    size_t used;
+} slack_t;
+
+//slab 页头，后面紧跟着对象
+typedef struct {
+    word_t next, prev;        //同一类里还有空位的页的句柄，0 表示没有
+    unsigned short size;      //对象大小
+    unsigned short nobjs, nfree;
+    unsigned short first;     //第一个对象相对页头的偏移
+    unsigned long used[SLAB_WORDS]; //第 i 位表示第 i 个对象已分配，nobjs 以后的位恒为 1
+} slab_t;
+
+//段: 一个 region 上连续的一段堆，两头各有序言块和结尾块，合并不会越过它们。
+//只有 arena 的最后一个段（当前段）会扩展，堆顶块也只在当前段里。
+typedef struct {
+    char *lo, *hi;           //region 的地址范围
+    int region;
+    unsigned long *slab_map; //段里第 i 页是不是 slab 页
+    unsigned long map_used;  //slab_map 里写过的字数，mm_init 之后也留着，重新用这个段时只清这一段
+    struct arena *arena;     //段属于哪个 arena，free 时用
+} segment_t;
+
+//一个 arena 是一个独立的堆: 自己的段、空闲链表和锁。
+//下面所有函数都操作当前线程的 arena 指针指向的那个 arena。
+typedef struct arena {
+    char *heap_listp;
+    char *free_lists[NUM_CLASSES];
+    unsigned long free_bitmap; //TLSF 下是第一级 bitmap
+#ifdef TLSF
+    unsigned int sl_bitmap[FL_COUNT];
+#else
+    char *free_tree; //大块 treap 的根
+#endif
+    slack_t slack[SLACK_SLOTS];
+    int slack_victim; //表满时被替换的位置
+    slab_t *slabs[SLAB_CLASSES]; //每类还有空位的 slab 页
+    unsigned int slab_demand[SLAB_CLASSES]; //每类请求的次数，到 SLAB_DEMAND 为止
+    void *quick[QUICK_CLASSES]; //用载荷串起来的 quick list
+    int quick_count;            //所有 quick list 里的块数
+    char *top;                  //堆顶的空闲块（wilderness），不在空闲链表里，最后才用
+    size_t grow_chunk;          //下次扩展堆时至少扩展多少，随最近的扩展频率翻倍或减半
+    unsigned long allocs;       //alloc_block 调用次数
+    unsigned long last_grow;    //上次扩展堆时的 allocs
+    unsigned long ops;          //加锁做的分配和释放次数，purge 的时钟
+    word_t dirty_head, dirty_tail; //dirty 链表上最早和最晚变成空闲的块
+    char *fresh;    //当前段里 [fresh, brk - DSIZE) 的空闲内存都是 0，空闲块开头的 DIRTY_END 字节除外
+    //第一个段的 slab 页 bitmap，之后的段放在段开头。HEAP64 下每个有 32 MB，
+    //不过只有写过的页才占内存，清的时候也只清写过的部分
+    unsigned long slab_map[SLAB_MAP_WORDS];
+    mm_stats_t stats;
+    segment_t seg[MAX_SEGMENTS];
+    int nsegs;     //在用的段数，只在持锁时增加，free 不加锁读
+    int nregions;  //已经要到 region 的段数，mm_init 之后按顺序重新使用
+    int region;    //当前段的 memlib region，0 是 mem_sbrk 的堆
+#ifdef THREAD_SAFE
+    pthread_mutex_t lock;
+    int nthreads;  //分配给这个 arena 的线程数
+    void *remote_free; //其他 arena 的线程释放的块，用载荷串成的无锁栈，持锁时一次取走
+#endif
+} arena_t;
 
 /*
  * mm_init - Called when a new trace starts.
  */
-static char *heap_listp = 0;
-static char *free_list_head = 0;
+static arena_t arenas[NARENAS];
+#ifdef THREAD_SAFE
+static __thread arena_t *arena;
+static __thread arena_t *home_arena; //线程分配到的 arena，malloc 从这里分配
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER; //保护 region 的创建和线程计数
+static int remote_free_on = 1; //释放别的 arena 的块时压进它的 remote_free，而不是去抢它的锁
+#else
+static arena_t *arena = &arenas[0];
+#endif
+
+//大块的映射不属于任何 arena，memlib 的映射表由 huge_lock 保护
+#ifdef THREAD_SAFE
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+#define HUGE_LOCK() pthread_mutex_lock(&huge_lock)
+#define HUGE_UNLOCK() pthread_mutex_unlock(&huge_lock)
+#else
+#define HUGE_LOCK()
+#define HUGE_UNLOCK()
+#endif
+static unsigned long huge_maps, huge_remaps; //在 huge_lock 下计数，mm_init 清零
+
+static inline int in_seg(const segment_t *s, void *ptr){
+    return (char *)ptr >= s->lo && (char *)ptr < s->hi;
+}
+
+//ptr 在 a 的第几个段里，不在返回 -1。通常只有一个段，先看段 0，不用读段数
+static inline int seg_index(arena_t *a, void *ptr){
+    if(in_seg(&a->seg[0], ptr)) return 0;
+    int n = __atomic_load_n(&a->nsegs, __ATOMIC_ACQUIRE);
+    for(int i = 1; i < n; i++)
+        if(in_seg(&a->seg[i], ptr)) return i;
+    return -1;
+}
+
+//ptr 所在的 a 的段，ptr 必须在 a 里
+static inline segment_t *seg_in(arena_t *a, void *ptr){
+    int i = seg_index(a, ptr);
+    assert(i >= 0);
+    return &a->seg[i];
+}
+
+//当前 arena 里 bp 的句柄。段 0 开头是 slab bitmap 或者序言块，不会有块的句柄是 0。
+//段 0 的句柄就是段内偏移: 通常只有这一个段，相减一次就够了，不查段表
+static inline word_t to_handle(void *bp){
+    unsigned long off = (char *)bp - arena->seg[0].lo;
+    int i;
+    if(off < MAX_HEAP) return (word_t)off;
+    i = seg_index(arena, bp);
+    return ((word_t)i << SEG_SHIFT) | (word_t)((char *)bp - arena->seg[i].lo);
+}
+
+static inline char *from_handle(word_t h){
+    if(h <= SEG_MASK) return arena->seg[0].lo + h;
+    return arena->seg[h >> SEG_SHIFT].lo + (h & SEG_MASK);
+}
+
+static inline segment_t *cur_seg(void){
+    return &arena->seg[arena->nsegs - 1];
+}
+
+//bp 必须在当前 arena 里，所以只有一个段时不用比较
+static inline int in_cur_seg(void *bp){
+    return arena->nsegs == 1 || in_seg(cur_seg(), bp);
+}
+
+//已分配块 bp（或者它的尾部）要变回空闲内存了: 它写过的内容，和后面要合并进来的空闲块
+//开头的链表指针，都会留在空闲块中间，fresh 至少要移过它们
+static inline void fresh_raise(void *bp){
+    char *next = NEXT_BLKP(bp);
+    char *end = GET_ALLOC(HDRP(next)) ? HDRP(next) : next + DIRTY_END;
+    if(in_cur_seg(bp) && end > arena->fresh) arena->fresh = end;
+}
+
+#ifdef THREAD_SAFE
+static unsigned long heap_gen; //每次 mm_init 加一，之前的线程缓存全部作废
+#ifndef PERCPU
+static __thread void *tcache[TCACHE_CLASSES];
+static __thread int tcache_count[TCACHE_CLASSES];
+static __thread unsigned long tcache_gen;
+#endif
+#endif
+
+#ifdef PERCPU
+//PERCPU 版本: 缓存按 CPU 而不是按线程分，线程再多内存也不会跟着涨。
+//链表用 restartable sequences 修改: 临界区被抢占或迁移到别的 CPU 时内核让它从 abort 处重来，
+//所以快速路径没有锁也没有原子指令。节点载荷的 0..7 字节是 next，
+//8..11 字节是压入时的链表长度（只用来决定什么时候还给中心堆）。
+#define MAX_CPUS 256
+#define NODE_COUNT(bp) (*(unsigned int *)((char *)(bp) + DSIZE))
+typedef struct {
+    void *head[TCACHE_CLASSES];
+} __attribute__((aligned(64))) cpu_cache_t;
+static cpu_cache_t cpu_cache[MAX_CPUS];
+#endif
 
 //Some tool functions:
 
@@ -103,12 +426,215 @@ static void *extend_heap(size_t words);
 static void *coalesce(void *bp);
 static void *find_fit(size_t asize);
 static void place(void *bp, size_t asize);
+static void split_tail(void *bp, size_t asize);
+static size_t slack_total(void);
+static void release_all_slack(void);
+static void *alloc_block(size_t asize);
+static void free_block(void *ptr);
+static void quick_flush(void);
+static void *slab_alloc(size_t size);
+static void slab_free(void *ptr);
+static int is_slab(segment_t *s, void *ptr);
+static segment_t *seg_of(void *ptr);
+#ifdef THREAD_SAFE
+static void *cache_get(size_t asize);
+static void cache_flush(void);
+static arena_t *thread_arena(void);
+static void remote_push(arena_t *a, void *first, void *last);
+static void remote_drain(void);
+#else
+#define thread_arena() (&arenas[0])
+#endif
 inline void set_next_prealloc(void *bp, size_t prealloc);
 
 inline void set_next_prealloc(void *bp, size_t prealloc){
     size_t size = GET_SIZE(HDRP(NEXT_BLKP(bp)));
     size_t alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(size,prealloc,alloc));
+    size_t grown = GET_GROWN(HDRP(NEXT_BLKP(bp)));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(size,prealloc,alloc) | grown);
+}
+
+#ifdef TLSF
+static inline int size_class(size_t size){
+    if(size < TLSF_SMALL) return size / DSIZE;
+    int fl = 63 - __builtin_clzl(size);
+    int sl = (size >> (fl - SL_LOG)) - SL_COUNT;
+    return (fl - FL_SHIFT + 1) * SL_COUNT + sl;
+}
+
+static inline void mark_class(int c){
+    arena->free_bitmap |= 1UL << (c / SL_COUNT);
+    arena->sl_bitmap[c / SL_COUNT] |= 1U << (c % SL_COUNT);
+}
+
+static inline void unmark_class(int c){
+    if((arena->sl_bitmap[c / SL_COUNT] &= ~(1U << (c % SL_COUNT))) == 0)
+        arena->free_bitmap &= ~(1UL << (c / SL_COUNT));
+}
+#else
+//size 所在的类: 小块按 8 字节线性映射，大块按最高位映射
+static inline int size_class(size_t size){
+    if(size <= SMALL_MAX) return (size - MINBLOCKSIZE) / GRAIN;
+    //SMALL_MAX = 2^7, (2^7, 2^8] -> NUM_SMALL_CLASSES, ..., (2^9, TREE_MIN) -> NUM_CLASSES - 1
+    int c = NUM_SMALL_CLASSES + (int)(8 * sizeof(unsigned long)) - __builtin_clzl(size - 1) - 8;
+    return MIN(c, NUM_CLASSES - 1);
+}
+
+static inline void mark_class(int c){
+    arena->free_bitmap |= 1UL << c;
+}
+
+static inline void unmark_class(int c){
+    arena->free_bitmap &= ~(1UL << c);
+}
+
+//treap: 按 (size, address) 做二叉搜索树，按地址的哈希做堆，期望深度 O(log n)。
+//优先级由地址算出，不需要额外存储；所有操作都不需要父指针。
+static inline unsigned int tree_prio(void *bp){
+    return (unsigned int)((char *)bp - arena->heap_listp) * 2654435761U;
+}
+
+static inline int tree_less(void *a, void *b){
+    size_t sa = GET_SIZE(HDRP(a)), sb = GET_SIZE(HDRP(b));
+    return sa < sb || (sa == sb && (char *)a < (char *)b);
+}
+
+static void *rotate_right(void *bp){
+    void *l = GET_LEFT(bp);
+    void *lr = GET_RIGHT(l);
+    SET_LEFT(bp, lr);
+    SET_RIGHT(l, bp);
+    return l;
+}
+
+static void *rotate_left(void *bp){
+    void *r = GET_RIGHT(bp);
+    void *rl = GET_LEFT(r);
+    SET_RIGHT(bp, rl);
+    SET_LEFT(r, bp);
+    return r;
+}
+
+//把 bp 插入以 root 为根的子树，返回新的根
+static void *tree_insert(void *root, void *bp){
+    void *child;
+    if(root == NULL) return bp;
+    if(tree_less(bp, root)){
+        child = tree_insert(GET_LEFT(root), bp);
+        SET_LEFT(root, child);
+        if(tree_prio(child) > tree_prio(root)) root = rotate_right(root);
+    } else {
+        child = tree_insert(GET_RIGHT(root), bp);
+        SET_RIGHT(root, child);
+        if(tree_prio(child) > tree_prio(root)) root = rotate_left(root);
+    }
+    return root;
+}
+
+//合并两棵子树，a 中的键都小于 b 中的键
+static void *tree_merge(void *a, void *b){
+    void *child;
+    if(a == NULL) return b;
+    if(b == NULL) return a;
+    if(tree_prio(a) > tree_prio(b)){
+        child = tree_merge(GET_RIGHT(a), b);
+        SET_RIGHT(a, child);
+        return a;
+    }
+    child = tree_merge(a, GET_LEFT(b));
+    SET_LEFT(b, child);
+    return b;
+}
+
+//从以 root 为根的子树中删除 bp（bp 的大小此时不能被修改过），返回新的根
+static void *tree_delete(void *root, void *bp){
+    void *child;
+    if(root == bp) return tree_merge(GET_LEFT(bp), GET_RIGHT(bp));
+    if(tree_less(bp, root)){
+        child = tree_delete(GET_LEFT(root), bp);
+        SET_LEFT(root, child);
+    } else {
+        child = tree_delete(GET_RIGHT(root), bp);
+        SET_RIGHT(root, child);
+    }
+    return root;
+}
+
+//best fit: 大小 >= asize 的块中最小的一个（同样大小取地址最低的）
+static void *tree_best_fit(size_t asize, size_t *steps){
+    void *res_bp = NULL;
+    for(void *bp = arena->free_tree; bp != NULL; ){
+        (*steps)++;
+        if(GET_SIZE(HDRP(bp)) >= asize){
+            res_bp = bp;
+            bp = GET_LEFT(bp);
+        }
+        else bp = GET_RIGHT(bp);
+    }
+    return res_bp;
+}
+#endif
+
+//记录一次查找检查了多少个空闲块、多少个 bin
+static inline void record_search(size_t steps, size_t bins){
+    arena->stats.searches++;
+    arena->stats.search_steps += steps;
+    arena->stats.max_steps = MAX(arena->stats.max_steps, steps);
+    arena->stats.max_bins = MAX(arena->stats.max_bins, bins);
+}
+
+//空闲块 bp 中间可以 purge 的整页，返回长度，起点放进 *lo
+static inline size_t purge_range(void *bp, char **lo){
+    unsigned long start = ((unsigned long)bp + DIRTY_END + page_size - 1) & ~(page_size - 1);
+    unsigned long end = (unsigned long)FTRP(bp) & ~(page_size - 1);
+    *lo = (char *)start;
+    return end > start ? end - start : 0;
+}
+
+//新的空闲块里有整页时接到 dirty 链表尾部
+static void dirty_add(void *bp){
+    word_t off = to_handle(bp);
+    char *lo;
+    if(params.purge_decay == 0 || purge_range(bp, &lo) == 0) return;
+    PUT(HDRP(bp), GET(HDRP(bp)) | DIRTY);
+    DIRTY_STAMP(bp) = arena->ops;
+    DIRTY_PREV(bp) = arena->dirty_tail;
+    DIRTY_NEXT(bp) = 0;
+    if(arena->dirty_tail != 0) DIRTY_NEXT(from_handle(arena->dirty_tail)) = off;
+    else arena->dirty_head = off;
+    arena->dirty_tail = off;
+}
+
+//bp 要被分配、合并或者收缩了，不再等着 purge
+static void dirty_forget(void *bp){
+    word_t prev, next;
+    if(!(GET(HDRP(bp)) & DIRTY)) return;
+    PUT(HDRP(bp), GET(HDRP(bp)) & ~DIRTY);
+    prev = DIRTY_PREV(bp); next = DIRTY_NEXT(bp);
+    if(prev != 0) DIRTY_NEXT(from_handle(prev)) = next;
+    else arena->dirty_head = next;
+    if(next != 0) DIRTY_PREV(from_handle(next)) = prev;
+    else arena->dirty_tail = prev;
+}
+
+//purge 空闲够久的块，all 时不管等了多久全部 purge。返回真正 purge 掉的字节数
+static size_t purge_decayed(int all){
+    char *bp, *lo;
+    size_t len, purged = 0;
+    while(arena->dirty_head != 0){
+        bp = from_handle(arena->dirty_head);
+        if(!all && arena->ops - DIRTY_STAMP(bp) < params.purge_decay) break;
+        dirty_forget(bp);
+        len = purge_range(bp, &lo);
+        if(mem_purge(lo, len) == 0){
+            //purge 过的页读出来是 0，接得上 fresh 就把它往下移
+            if(in_cur_seg(lo) && lo < arena->fresh && arena->fresh <= lo + len) arena->fresh = lo;
+            arena->stats.purges++;
+            arena->stats.purged += len;
+            purged += len;
+        }
+    }
+    return purged;
 }
 
 static void remove_from_free_list(void *bp){
@@ -116,61 +642,69 @@ static void remove_from_free_list(void *bp){
     if(bp == NULL || GET_ALLOC(HDRP(bp)) == 1){
         return;
     }
+    dirty_forget(bp);
+    if(bp == arena->top){
+        arena->top = NULL;
+        return;
+    }
+#ifndef TLSF
+    if(GET_SIZE(HDRP(bp)) >= TREE_MIN){
+        arena->free_tree = tree_delete(arena->free_tree, bp);
+        SET_LEFT(bp, 0); SET_RIGHT(bp, 0);
+        return;
+    }
+#endif
+    int c = size_class(GET_SIZE(HDRP(bp)));
     void *prev, *next;
     prev = GET_PREV(bp); next = GET_NEXT(bp);
     SET_PREV(bp, 0); SET_NEXT(bp, 0);//消除前驱后继
-    if(prev == NULL && next == NULL){
-        free_list_head = NULL;
-    }
-    else if(prev == NULL && next != NULL){
+    if(prev == NULL){
         //next 成为第一个空节点:
-        SET_PREV(next, 0);
-        free_list_head = next;
-    }
-    else if(prev != NULL && next == NULL){
-        SET_NEXT(prev, 0);
+        arena->free_lists[c] = next;
+        if(next != NULL) SET_PREV(next, 0);
+        else unmark_class(c);
     }
     else {
         SET_NEXT(prev, next);
-        SET_PREV(next, prev);
+        if(next != NULL) SET_PREV(next, prev);
     }
-    //mm_checkheap(2);
 }
 
 static void insert_to_free_list(void *bp){
     if(bp == NULL) return;
-    //如果列表是空的，直接插入
-    if(free_list_head == NULL){
-        //printf("insert to empty list\n");
-        free_list_head = bp;
-        SET_NEXT(bp, 0);
-        SET_PREV(bp, 0);
+    if(GET_SIZE(HDRP(bp)) >= page_size) dirty_add(bp);
+    //紧挨着当前段结尾块的空闲块是堆顶，单独记着；之前的段结尾的空闲块照常进链表
+    if(GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0 && seg_index(arena, bp) == arena->nsegs - 1){
+        arena->top = bp;
+        return;
     }
-    else {
-        //插到头部：
-        //printf("insert to head\n");
-        //printf("bp: %p\n", bp);
-        //printf("free_list_head: %p\n", free_list_head);
-        //printf("NEXT %p\n", ((unsigned int *)(bp)+1));
-        //unsigned int tt = free_list_head;
-        //SET_PREV(bp, 0);
-        SET_NEXT(bp, free_list_head);
-        //void *tmp = GET_NEXT(bp);
-        //printf("NEXT free pointer: %p\n", tmp);
-        SET_PREV(free_list_head, bp);
-        //tmp = 
-        free_list_head = bp;
-        SET_PREV(bp, 0);
+#ifndef TLSF
+    if(GET_SIZE(HDRP(bp)) >= TREE_MIN){
+        SET_LEFT(bp, 0); SET_RIGHT(bp, 0);
+        arena->free_tree = tree_insert(arena->free_tree, bp);
+        return;
     }
-    //mm_checkheap(2);
-    return;
+#endif
+    int c = size_class(GET_SIZE(HDRP(bp)));
+    //插到对应类的头部：
+    SET_PREV(bp, 0);
+    SET_NEXT(bp, arena->free_lists[c]);
+    if(arena->free_lists[c] != NULL) SET_PREV(arena->free_lists[c], bp);
+    arena->free_lists[c] = bp;
+    mark_class(c);
 }
 
 static void *extend_heap(size_t words){
-    char *bp;
+    char *bp, *fresh, *merged;
     size_t prealloc;
-    words = (words & 1) ? (words + 1) * WSIZE : words * WSIZE;
-    if((long)(bp = mem_sbrk(words)) == -1) return NULL;
+    words = GRAIN * ((words * WSIZE + GRAIN - 1) / GRAIN); //以下 words 是字节数
+    //当前段放不下就不去碰 memlib，由调用者换新段
+    if(words > (size_t)(cur_seg()->hi - (char *)mem_region_sbrk(arena->region, 0))) return NULL;
+    fresh = mem_region_fresh(arena->region);
+    if((long)(bp = mem_region_sbrk(arena->region, words)) == -1) return NULL;
+    //之前收缩掉又要回来的部分还留着旧数据
+    if(fresh > bp && fresh > arena->fresh) arena->fresh = fresh;
+    arena->stats.heap_extends++;
     //printf("extend heap: %p\n", bp);
     //将原来尾块的头部（尾块只有头部）替换为新的空闲块的头部，新的空闲块的大小为words，然后设定新的尾块以及新的空闲块的尾部
     //memset(bp, 0, words);
@@ -183,7 +717,46 @@ static void *extend_heap(size_t words){
     //printf("3\n");
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 0, 1)); //new epilogue header
     //printf("4\n");
-    return coalesce(bp);
+    merged = coalesce(bp);
+    //和堆顶合并以后，原来的尾部和结尾块留在块中间，清掉它们，新空间才接得上 fresh
+    if(merged != bp){
+        if(bp - DSIZE >= merged + DIRTY_END) PUT(bp - DSIZE, 0);
+        if(bp - WSIZE >= merged + DIRTY_END) PUT(bp - WSIZE, 0);
+    }
+    return merged;
+}
+
+//把堆顶空闲块超出 pad 的部分还给 memlib，返回还回去的字节数
+static size_t trim_top(size_t pad){
+    char *bp = arena->top;
+    size_t size, keep;
+    if(bp == NULL) return 0;
+    size = GET_SIZE(HDRP(bp));
+    keep = GRAIN * ((pad + GRAIN - 1) / GRAIN);
+    if(keep != 0 && keep < MINBLOCKSIZE) keep = MINBLOCKSIZE;
+    if(keep >= size) return 0;
+    dirty_forget(bp);
+    if(keep == 0){
+        //整块还回去，它的头部成为新的结尾块
+        PUT(HDRP(bp), PACK(0, GET_PREALLOC(HDRP(bp)), 1));
+        arena->top = NULL;
+    }
+    else {
+        PUT(HDRP(bp), PACK(keep, GET_PREALLOC(HDRP(bp)), 0));
+        PUT(FTRP(bp), PACK(keep, GET_PREALLOC(HDRP(bp)), 0));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 0, 1)); //new epilogue header
+        if(keep >= page_size) dirty_add(bp);
+    }
+    mem_region_sbrk(arena->region, -(intptr_t)(size - keep));
+    arena->stats.heap_trims++;
+    arena->stats.trimmed += size - keep;
+    return size - keep;
+}
+
+//释放之后堆顶超过 trim_threshold 就收缩到 top_pad
+static inline void auto_trim(void){
+    if(params.trim_threshold != 0 && arena->top != NULL && GET_SIZE(HDRP(arena->top)) > params.trim_threshold)
+        trim_top(params.top_pad);
 }
 
 static void* coalesce(void *bp)
@@ -201,7 +774,8 @@ static void* coalesce(void *bp)
         insert_to_free_list(bp);
         return bp;
     }
-    else if (prev_alloc && !next_alloc)
+    arena->stats.coalesces += (!prev_alloc) + (!next_alloc);
+    if (prev_alloc && !next_alloc)
     {
         remove_from_free_list(next_bp);
         size += GET_SIZE(HDRP(next_bp));
@@ -235,23 +809,36 @@ static void* coalesce(void *bp)
 }
 
 
-static void *find_fit_in_list(size_t asize){
-    //mm_checkheap(1);
-    for(void *bp = free_list_head; bp != NULL; bp = GET_NEXT(bp)){
-        //printf("heap_listp: %p\n", heap_listp);
-        //printf("heap_bound: %p\n", heap_listp + mem_heapsize());
-        //printf("bp: %p\n", bp);
-        if(GET_SIZE(HDRP(bp)) >= asize){
-            return bp;
+#ifdef TLSF
+//good fit: 本 bin 的第一个块放得下就用它，否则取更大的第一个非空 bin 的第一个块，
+//那里的任何块都比 asize 大。最多检查 2 个块、2 个 bin。
+static void *find_fit(size_t asize){
+    int c = size_class(asize);
+    if(arena->free_lists[c] != NULL && GET_SIZE(HDRP(arena->free_lists[c])) >= asize){
+        record_search(1, 1);
+        return arena->free_lists[c];
+    }
+    int fl = (c + 1) / SL_COUNT, sl = (c + 1) % SL_COUNT;
+    unsigned int slmap = (fl < FL_COUNT) ? arena->sl_bitmap[fl] & (~0U << sl) : 0;
+    if(slmap == 0){
+        unsigned long flmap = arena->free_bitmap & (~0UL << (fl + 1));
+        if(flmap == 0){
+            record_search(1, 1);
+            return NULL;
         }
+        fl = __builtin_ctzl(flmap);
+        slmap = arena->sl_bitmap[fl];
     }
-    return NULL;
+    record_search(2, 2);
+    return arena->free_lists[fl * SL_COUNT + __builtin_ctz(slmap)];
 }
-
-static void *find_num_fit_in_list(size_t asize){
+#else
+//在一个类的链表中选取前 FIRST_FIT_NUM 个能放下的块中最小的一个:
+static void *find_num_fit_in_list(void *head, size_t asize, size_t *steps){
     size_t cur_num = 0, cur_size = -1;
     void *res_bp = NULL;
-    for(void *bp = free_list_head; bp != NULL && cur_num < FIRST_FIT_NUM; bp = GET_NEXT(bp)){
+    for(void *bp = head; bp != NULL && cur_num < FIRST_FIT_NUM; bp = GET_NEXT(bp)){
+        (*steps)++;
         if(GET_SIZE(HDRP(bp)) >= asize){
             cur_num++;
             if(!res_bp){
@@ -267,9 +854,35 @@ static void *find_num_fit_in_list(size_t asize){
 }
 
 static void *find_fit(size_t asize){
-    //return find_fit_in_list(asize); 
-    return find_num_fit_in_list(asize);
+    size_t steps = 0;
+    void *bp;
+    //大块直接在树里找 best fit
+    if(asize >= TREE_MIN){
+        bp = tree_best_fit(asize, &steps);
+        record_search(steps, 1);
+        return bp;
+    }
+    int c = size_class(asize);
+    //本类中的块不一定都够大，先在本类里找
+    if((arena->free_bitmap >> c) & 1){
+        if((bp = find_num_fit_in_list(arena->free_lists[c], asize, &steps)) != NULL){
+            record_search(steps, 1);
+            return bp;
+        }
+    }
+    //更大的类中任何一个块都放得下，用 ctz 找第一个非空的类
+    unsigned long map = (c + 1 < NUM_CLASSES) ? arena->free_bitmap & (~0UL << (c + 1)) : 0;
+    if(map != 0){
+        bp = find_num_fit_in_list(arena->free_lists[__builtin_ctzl(map)], asize, &steps);
+        record_search(steps, 2);
+        return bp;
+    }
+    //链表里都没有，树里最小的块（如果有）就够大
+    bp = tree_best_fit(asize, &steps);
+    record_search(steps, 2);
+    return bp;
 }
+#endif
 
 static void place(void* bp, size_t asize)
 {
@@ -278,6 +891,7 @@ static void place(void* bp, size_t asize)
 
     if ((size - asize) >= MINBLOCKSIZE) // split block
     {
+        arena->stats.splits++;
         PUT(HDRP(bp), PACK(asize, GET_PREALLOC(HDRP(bp)), 1));
         //PUT(FTRP(bp), PACK(asize, GET_PREALLOC(HDRP(bp)), 1));
         //void* new_bp = ;
@@ -296,21 +910,111 @@ static void place(void* bp, size_t asize)
     }
 }
 
-int mm_init(void){
+//在 p 开始的 4 个字里写好序言块和结尾块，返回序言块的尾部
+static char *put_fences(char *p){
+    PUT(p, 0); /*Alignment padding*/
+    //序言块:头部+尾部(序言块的状态是被占用的, 大小为两字节（头部和尾部各一个字节）)
+    PUT(p + (1 * WSIZE), PACK(DSIZE, 1, 1));
+    PUT(p + (2 * WSIZE), PACK(DSIZE, 1, 1));
+    PUT(p + (3 * WSIZE), PACK(0, 1, 1));
+    return p + DSIZE;
+}
+
+//向 memlib 要一个 region 做 arena 的第 i 个段。段的范围只设置一次，之后 seg_of 不加锁读它
+static int segment_region(int i){
+    segment_t *s = &arena->seg[i];
+    if(i > 0 || arena != &arenas[0]){
+#ifdef THREAD_SAFE
+        pthread_mutex_lock(&arenas_lock);
+#endif
+        s->region = mem_region_new();
+#ifdef THREAD_SAFE
+        pthread_mutex_unlock(&arenas_lock);
+#endif
+        if(s->region < 0){
+            s->region = 0;
+            return -1;
+        }
+    }
+    s->lo = mem_region_lo(s->region);
+    s->hi = s->lo + mem_region_size();
+    s->arena = arena;
+    arena->nregions++;
+    return 0;
+}
+
+//一个新段最多能放多大的块: 除掉开头的 slab bitmap 和两头的序言块、结尾块
+#define SEG_MAP_BYTES (GRAIN * ((MAX_HEAP / SLAB_PAGE / 8 + GRAIN - 1) / GRAIN))
+#define SEG_CAPACITY (MAX_HEAP - SEG_MAP_BYTES - 4 * WSIZE)
+
+//当前段放不下 need 字节了: 换到一个新段，mm_init 之前用过的 region 优先。
+//新段开头是它的 slab bitmap，然后是序言块和结尾块；旧段的堆顶块回到普通的空闲链表里。
+static int segment_new(size_t need){
+    segment_t *s;
+    char *top, *brk, *fresh;
+    int i = arena->nsegs;
+    if(i == MAX_SEGMENTS || need > SEG_CAPACITY) return -1;
+    if(i == arena->nregions && segment_region(i) < 0) return -1;
+    s = &arena->seg[i];
+    brk = mem_region_sbrk(s->region, 0);
+    if(brk != s->lo) mem_region_sbrk(s->region, -(intptr_t)(brk - s->lo));
+    fresh = mem_region_fresh(s->region);
+    if(mem_region_sbrk(s->region, SEG_MAP_BYTES + 4 * WSIZE) == (void *)-1) return -1;
+    s->slab_map = (unsigned long *)s->lo;
+    //新 region 是 0，用过的 region 里 bitmap 只有前 map_used 个字写过
+    memset(s->slab_map, 0, s->map_used * sizeof(unsigned long));
+    s->map_used = 0;
+    put_fences(s->lo + SEG_MAP_BYTES);
+    if((top = arena->top) != NULL) remove_from_free_list(top);
+    arena->region = s->region;
+    arena->fresh = MAX(fresh, s->lo + SEG_MAP_BYTES + 4 * WSIZE);
+    __atomic_store_n(&arena->nsegs, i + 1, __ATOMIC_RELEASE);
+    insert_to_free_list(top);
+    arena->stats.segments = MAX(arena->stats.segments, (unsigned long)i + 1);
+    return 0;
+}
+
+//在当前 arena 的第一个段上建一个空堆，region 还没有就先向 memlib 要一个。
+//之前的段留着 region，堆长到那里时再按顺序用
+static int arena_init(void){
+    if(arena->nregions == 0){
+        if(segment_region(0) < 0) return -1;
+        arena->seg[0].slab_map = arena->slab_map;
+    }
+    arena->region = arena->seg[0].region;
+    __atomic_store_n(&arena->nsegs, 1, __ATOMIC_RELEASE);
+    arena->fresh = mem_region_fresh(arena->region);
     //printf("mm_init\n");
-    if((heap_listp = mem_sbrk(4 * WSIZE)) == (void *) -1) return -1;
+    if((arena->heap_listp = mem_region_sbrk(arena->region, 4 * WSIZE)) == (void *) -1) return -1;
     //printf("Finish heap init\n");
-    PUT(heap_listp, 0); /*Alignment padding*/
-    //序言块:头部+尾部(序言块的状态是被占用的, 大小为两字节（头部和尾部各一个字节）)
-    PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1, 1));
-    PUT(heap_listp + (2 * WSIZE), PACK(DSIZE, 1, 1));
-    PUT(heap_listp + (3 * WSIZE), PACK(0, 1, 1));
-    heap_listp += DSIZE; //指向序言块的尾部
-    free_list_head = NULL;
+    arena->heap_listp = put_fences(arena->heap_listp); //指向序言块的尾部
+    arena->fresh = MAX(arena->fresh, arena->heap_listp + DSIZE);
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+    arena->free_bitmap = 0;
+#ifdef TLSF
+    memset(arena->sl_bitmap, 0, sizeof(arena->sl_bitmap));
+#else
+    arena->free_tree = NULL;
+#endif
+    memset(&arena->stats, 0, sizeof(arena->stats));
+    arena->stats.segments = 1;
+    memset(arena->slack, 0, sizeof(arena->slack));
+    arena->slack_victim = 0;
+    memset(arena->slabs, 0, sizeof(arena->slabs));
+    memset(arena->slab_demand, 0, sizeof(arena->slab_demand));
+    memset(arena->quick, 0, sizeof(arena->quick));
+    arena->quick_count = 0;
+    arena->top = NULL;
+    arena->grow_chunk = 0;
+    arena->allocs = arena->last_grow = 0;
+    arena->ops = 0;
+    arena->dirty_head = arena->dirty_tail = 0;
+    memset(arena->slab_map, 0, arena->seg[0].map_used * sizeof(unsigned long));
+    arena->seg[0].map_used = 0;
     //printf("Finish heap init\n");
 
 #ifdef NEXT_FIT
-    recover = heap_listp;
+    recover = arena->heap_listp;
 #endif
 
     //扩展堆
@@ -319,15 +1023,70 @@ int mm_init(void){
     //mm_checkheap(1);
     return 0;
 }
+
+int mm_init(void){
+    //其他 arena 的 region 已经被 mem_reset_brk 清空，等第一次用到时再建堆。
+    //统计也要清掉，不然 mm_getstats 会把上一次运行的计数加进来
+    for(int i = 1; i < NARENAS; i++){
+        arenas[i].heap_listp = 0;
+        memset(&arenas[i].stats, 0, sizeof(arenas[i].stats));
+    }
+#ifdef THREAD_SAFE
+    for(int i = 0; i < NARENAS; i++) arenas[i].remote_free = NULL;
+    __atomic_store_n(&heap_gen, heap_gen + 1, __ATOMIC_RELAXED);
+#endif
+#ifdef PERCPU
+    memset(cpu_cache, 0, sizeof(cpu_cache));
+#endif
+    arena = &arenas[0];
+    page_size = mem_pagesize();
+    //上一个 trace 留下的映射已经被 mem_reset_brk 拆掉了
+    huge_maps = huge_remaps = 0;
+    return arena_init();
+}
 size_t malloc_cnt = 0;
-void *malloc(size_t size){
-    //printf("malloc %ld\n", size);
-    size_t adjust_size, extend_size;
+
+//堆顶的空闲块够大就返回它
+static inline void *fit_top(size_t asize){
+    return (arena->top != NULL && GET_SIZE(HDRP(arena->top)) >= asize) ? arena->top : NULL;
+}
+
+//扩展堆的大小: 至少是缺的 shortfall。扩展得频繁（距上次扩展不超过 grow_window 次分配）时
+//多扩展的部分翻倍，最多到 grow_max；不频繁时减半，小于 grow_min 就不再多扩展。
+//多扩展的部分还不超过堆大小的 1/GROW_SHARE。
+static size_t grow_size(size_t shortfall){
+    size_t heap = (char *)mem_region_sbrk(arena->region, 0) - cur_seg()->lo;
+    if(arena->allocs - arena->last_grow <= params.grow_window)
+        arena->grow_chunk = MIN(MAX(arena->grow_chunk * 2, params.grow_min), params.grow_max);
+    else if((arena->grow_chunk /= 2) < params.grow_min)
+        arena->grow_chunk = 0;
+    arena->last_grow = arena->allocs;
+    return ALIGN(MAX(MAX(shortfall, MIN(arena->grow_chunk, heap / GROW_SHARE)), MINBLOCKSIZE));
+}
+
+//每次从堆里分配之前: 建好 arena 的堆，计数，收回别的线程还回来的块
+static int alloc_begin(void){
+    //这个 arena 还没有堆: 第一次用到，或者 mm_init 之后
+    if(arena->heap_listp == 0 && arena_init() < 0) return -1;
+    arena->allocs++;
+    arena->ops++;
+#ifdef THREAD_SAFE
+    remote_drain();
+#endif
+    return 0;
+}
+
+static void *alloc_block(size_t adjust_size){
+    size_t extend_size;
     char *bp;
-    //忽略无效请求
-    if(size == 0) return NULL;
-    //调整块大小
-    adjust_size = MAX(MINBLOCKSIZE, DSIZE * ((size + WSIZE + DSIZE - 1) / DSIZE));
+    if(alloc_begin() < 0) return NULL;
+    //同样大小的块刚被释放过，直接拿走
+    if(adjust_size <= QUICK_MAX && (bp = arena->quick[(adjust_size - MINBLOCKSIZE) / GRAIN]) != NULL){
+        arena->quick[(adjust_size - MINBLOCKSIZE) / GRAIN] = *(void **)bp;
+        arena->quick_count--;
+        arena->stats.quick_hits++;
+        return bp;
+    }
     //搜索空闲链表
     //printf("Start search!\n");
     if((bp = find_fit(adjust_size)) != NULL){
@@ -338,36 +1097,754 @@ void *malloc(size_t size){
         //mm_checkheap(2);
         return bp;
     }
-    //没有找到合适的空闲块，扩展堆
-    //extend_size = MAX(adjust_size, CHUNKSIZE);
-    extend_size = adjust_size;
-    if((bp = extend_heap(extend_size / WSIZE)) == NULL) return NULL;
+    //quick list 里的块合并以后也许就放得下了
+    if(arena->quick_count > 0){
+        quick_flush();
+        if((bp = find_fit(adjust_size)) != NULL){
+            place(bp, adjust_size);
+            return bp;
+        }
+    }
+    //空闲链表里都放不下，最后才切堆顶的空闲块，让它尽量保持完整
+    if((bp = fit_top(adjust_size)) != NULL){
+        place(bp, adjust_size);
+        return bp;
+    }
+    //要扩展堆了: 如果 realloc 预留的空间加起来够用，先还回来再找一次
+    if(slack_total() >= adjust_size){
+        release_all_slack();
+        if((bp = find_fit(adjust_size)) != NULL || (bp = fit_top(adjust_size)) != NULL){
+            place(bp, adjust_size);
+            return bp;
+        }
+    }
+    //没有找到合适的空闲块，扩展堆: 堆顶是空闲块时只扩展缺的部分，新的空间和它合并
+    extend_size = grow_size(adjust_size - (arena->top != NULL ? GET_SIZE(HDRP(arena->top)) : 0));
+    if((bp = extend_heap(extend_size / WSIZE)) == NULL){
+        //当前段满了: 在新段里从头扩展，多扩展的部分放不下就只要 adjust_size
+        if(segment_new(adjust_size) < 0) return NULL;
+        extend_size = grow_size(adjust_size);
+        if((bp = extend_heap(extend_size / WSIZE)) == NULL && (bp = extend_heap(adjust_size / WSIZE)) == NULL)
+            return NULL;
+    }
     //printf("hhh extend!\n");
     place(bp, adjust_size);
     //mm_checkheap(2);
     return bp;
 }
 
-void free(void *ptr){
-    //ptr为空指针，直接返回
-    //printf("free %p\n", ptr);
-    if(ptr == NULL) return;
+//bp 之后第一个按 align 对齐、而且前面剩下的部分能单独成块的载荷地址
+static inline char *align_payload(char *bp, size_t align){
+    char *abp = (char *)(((unsigned long)bp + align - 1) & ~(unsigned long)(align - 1));
+    if(abp != bp && abp - bp < MINBLOCKSIZE) abp += align;
+    return abp;
+}
+
+//按 align 对齐的块: 多要一些空间，把前面对不齐的部分切成空闲块，后面多的部分再切回去。
+//没有够大的空闲块时只把堆扩展到对齐后的块放得下为止。当前段满了就到新段里再找一次
+static void *aligned_fit(size_t asize, size_t align){
+    char *bp, *abp, *brk;
+    size_t size, lead, top_size = 0;
+    long extend;
+    if((bp = find_fit(asize + align + MINBLOCKSIZE)) == NULL && arena->quick_count > 0){
+        quick_flush();
+        bp = find_fit(asize + align + MINBLOCKSIZE);
+    }
+    if(bp != NULL){
+        place(bp, asize + align + MINBLOCKSIZE);
+    } else {
+        //结尾块的 prealloc 位为 0 说明堆顶是空闲块，新块从它开始
+        brk = mem_region_sbrk(arena->region, 0);
+        if(!GET_PREALLOC(brk - WSIZE)) top_size = GET_SIZE(brk - DSIZE);
+        bp = brk - top_size;
+        extend = align_payload(bp, align) - bp + asize - top_size;
+        if(extend > 0 && extend_heap(extend / WSIZE) == NULL){
+            //当前段满了，到新段里重来一次
+            if(segment_new(asize + align + MINBLOCKSIZE) < 0) return NULL;
+            return aligned_fit(asize, align);
+        }
+        place(bp, GET_SIZE(HDRP(bp)));
+    }
+    abp = align_payload(bp, align);
+    if(abp != bp){
+        size = GET_SIZE(HDRP(bp));
+        lead = abp - bp;
+        PUT(HDRP(bp), PACK(lead, GET_PREALLOC(HDRP(bp)), 0));
+        PUT(FTRP(bp), PACK(lead, GET_PREALLOC(HDRP(bp)), 0));
+        PUT(HDRP(abp), PACK(size - lead, 0, 1));
+        SET_PREV(bp, 0); SET_NEXT(bp, 0);
+        coalesce(bp);
+    }
+    split_tail(abp, asize);
+    return abp;
+}
+
+//和 alloc_block 一样先计数、收回远程释放的块
+static void *alloc_aligned_block(size_t asize, size_t align){
+    if(alloc_begin() < 0) return NULL;
+    return aligned_fit(asize, align);
+}
+
+//只有对象比加上头部的块小时才值得放进 slab
+static inline int slab_eligible(size_t size){
+    return size <= SLAB_MAX && ALIGN(size) < ADJUST_SIZE(size);
+}
+
+//a 里这一类的请求够多了才用 slab。计数到阈值就不再写，之后只有读
+static inline int slab_wanted(arena_t *a, size_t size){
+    unsigned int *demand = &a->slab_demand[SLAB_CLASS(ALIGN(size))];
+    if(__atomic_load_n(demand, __ATOMIC_RELAXED) >= SLAB_DEMAND) return 1;
+    __atomic_fetch_add(demand, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+//映射一块能放下 size 字节载荷的内存，长度按页取整
+static void *huge_alloc(size_t size){
+    size_t len;
+    char *m;
+    if(size > (size_t)-1 - HUGE_HDR - page_size) return NULL;
+    len = (size + HUGE_HDR + page_size - 1) & ~(page_size - 1);
+    HUGE_LOCK();
+    if((m = mem_map(len)) != NULL) huge_maps++;
+    HUGE_UNLOCK();
+    if(m == NULL) return NULL;
+    *(size_t *)m = len;
+    return m + HUGE_HDR;
+}
+
+static void huge_free(void *ptr){
+    HUGE_LOCK();
+    mem_unmap((char *)ptr - HUGE_HDR);
+    HUGE_UNLOCK();
+}
+
+static inline int huge_wanted(size_t size){
+    return params.mmap_threshold != 0 && size >= params.mmap_threshold;
+}
+
+//大块还够大时用 mem_remap 调整映射，页表搬过去，不拷贝数据；
+//缩到阈值以下就搬回堆里
+static void *huge_realloc(void *ptr, size_t size){
+    size_t len = HUGE_LEN(ptr), newlen;
+    char *m;
+    void *newptr;
+    if(huge_wanted(size) && size <= (size_t)-1 - HUGE_HDR - page_size){
+        newlen = (size + HUGE_HDR + page_size - 1) & ~(page_size - 1);
+        if(newlen == len) return ptr;
+        HUGE_LOCK();
+        if((m = mem_remap((char *)ptr - HUGE_HDR, newlen)) != NULL) huge_remaps++;
+        HUGE_UNLOCK();
+        if(m != NULL){
+            *(size_t *)m = newlen;
+            return m + HUGE_HDR;
+        }
+        //缩小失败时原来的映射照样能用
+        if(newlen < len) return ptr;
+    }
+    if((newptr = malloc(size)) == NULL) return NULL;
+    memcpy(newptr, ptr, MIN(size, len - HUGE_HDR));
+    huge_free(ptr);
+    return newptr;
+}
+
+void *malloc(size_t size){
+    //printf("malloc %ld\n", size);
+    size_t adjust_size;
+    char *bp;
+    //忽略无效请求
+    if(size == 0) return NULL;
+    //映射失败就退回到堆里分配
+    if(huge_wanted(size) && (bp = huge_alloc(size)) != NULL) return bp;
+    if(slab_eligible(size) && slab_wanted(thread_arena(), size)){
+        arena = thread_arena();
+        LOCK();
+        bp = slab_alloc(size);
+        UNLOCK();
+        return bp;
+    }
+    //调整块大小
+    adjust_size = ADJUST_SIZE(size);
+#ifdef THREAD_SAFE
+    if(adjust_size <= TCACHE_MAX) return cache_get(adjust_size);
+#endif
+    arena = thread_arena();
+    LOCK();
+    bp = alloc_block(adjust_size);
+    UNLOCK();
+    return bp;
+}
+
+//slack 表里预留的总字节数
+static size_t slack_total(void){
+    size_t total = 0;
+    for(int i = 0; i < SLACK_SLOTS; i++)
+        if(arena->slack[i].bp != NULL) total += GET_SIZE(HDRP(arena->slack[i].bp)) - arena->slack[i].used;
+    return total;
+}
+
+static slack_t *find_slack(void *bp){
+    for(int i = 0; i < SLACK_SLOTS; i++)
+        if(arena->slack[i].bp == bp) return &arena->slack[i];
+    return NULL;
+}
+
+static void forget_slack(void *bp){
+    slack_t *s = find_slack(bp);
+    if(s != NULL) s->bp = NULL;
+}
+
+//把预留的部分切下来还给空闲链表
+static void release_slack(slack_t *s){
+    size_t size = GET_SIZE(HDRP(s->bp));
+    fresh_raise(s->bp);
+    split_tail(s->bp, s->used);
+    arena->stats.slack_released += size - GET_SIZE(HDRP(s->bp));
+    s->bp = NULL;
+}
+
+static void add_slack(void *bp, size_t used){
+    slack_t *s = find_slack(NULL);
+    if(s == NULL){
+        s = &arena->slack[arena->slack_victim];
+        arena->slack_victim = (arena->slack_victim + 1) % SLACK_SLOTS;
+        release_slack(s);
+    }
+    s->bp = bp;
+    s->used = used;
+}
+
+static void release_all_slack(void){
+    for(int i = 0; i < SLACK_SLOTS; i++)
+        if(arena->slack[i].bp != NULL) release_slack(&arena->slack[i]);
+}
+
+void mm_release_slack(void){
+    for(int i = 0; i < NARENAS; i++){
+        if(arenas[i].heap_listp == 0) continue;
+        arena = &arenas[i];
+        LOCK();
+        release_all_slack();
+        UNLOCK();
+    }
+}
+
+int mm_trim(size_t pad){
+    size_t released = 0;
+#ifdef THREAD_SAFE
+    cache_flush();
+#endif
+    for(int i = 0; i < NARENAS; i++){
+        if(arenas[i].heap_listp == 0) continue;
+        arena = &arenas[i];
+        LOCK();
+#ifdef THREAD_SAFE
+        remote_drain();
+#endif
+        //quick list 里的块合并之后才能并进堆顶
+        quick_flush();
+        released += trim_top(pad);
+        released += purge_decayed(1);
+        UNLOCK();
+    }
+    return released != 0;
+}
+
+//真正释放 ptr: 改成空闲块并和相邻的空闲块合并
+static void release_block(void *ptr){
     size_t size = GET_SIZE(HDRP(ptr));
     size_t prealloc = GET_PREALLOC(HDRP(ptr));
     //改变头部和尾部的状态位
-    if (heap_listp == 0){
+    if (arena->heap_listp == 0){
         //printf("?????????????????????\n");
         mm_init();
     }
+    if(GET_GROWN(HDRP(ptr))) forget_slack(ptr);
+    fresh_raise(ptr);
     PUT(HDRP(ptr), PACK(size, prealloc, 0));
     PUT(FTRP(ptr), PACK(size, prealloc, 0));
-    PUT(HDRP(NEXT_BLKP(ptr)), PACK(GET_SIZE(HDRP(NEXT_BLKP(ptr))), 0, GET_ALLOC(HDRP(NEXT_BLKP(ptr)))));
+    set_next_prealloc(ptr, 0);
     if(!GET_ALLOC(HDRP(NEXT_BLKP(ptr))))PUT(FTRP(NEXT_BLKP(ptr)), PACK(GET_SIZE(HDRP(NEXT_BLKP(ptr))), 0, GET_ALLOC(HDRP(NEXT_BLKP(ptr)))));
     SET_PREV(ptr, 0); SET_NEXT(ptr, 0);
     coalesce(ptr);
     //mm_checkheap(2);
 }
 
+//把所有 quick list 里的块真正释放
+static void quick_flush(void){
+    for(int c = 0; c < QUICK_CLASSES; c++){
+        while(arena->quick[c] != NULL){
+            void *bp = arena->quick[c];
+            arena->quick[c] = *(void **)bp;
+            release_block(bp);
+        }
+    }
+    arena->quick_count = 0;
+}
+
+//小块先放进 quick list，不合并；slack 表里的块可能被切小，直接释放
+static void free_block(void *ptr){
+    size_t size = GET_SIZE(HDRP(ptr));
+    if(size > QUICK_MAX || GET_GROWN(HDRP(ptr)) || !__atomic_load_n(&quick_on, __ATOMIC_RELAXED)){
+        release_block(ptr);
+        return;
+    }
+    if(arena->quick_count >= QUICK_LIMIT) quick_flush();
+    *(void **)ptr = arena->quick[(size - MINBLOCKSIZE) / GRAIN];
+    arena->quick[(size - MINBLOCKSIZE) / GRAIN] = ptr;
+    arena->quick_count++;
+
+}
+
+//ptr 是不是段 s 的某个 slab 页里的对象。别的线程可能同时改同一个字里别的页的位，所以用原子操作
+static int is_slab(segment_t *s, void *ptr){
+    unsigned long page = ((char *)ptr - s->lo) / SLAB_PAGE;
+    return (__atomic_load_n(&s->slab_map[page / 64], __ATOMIC_RELAXED) >> (page % 64)) & 1;
+}
+
+static void slab_mark(void *page, int on){
+    segment_t *s = seg_in(arena, page);
+    unsigned long i = ((char *)page - s->lo) / SLAB_PAGE;
+    if(i / 64 >= s->map_used) s->map_used = i / 64 + 1;
+    if(on) __atomic_fetch_or(&s->slab_map[i / 64], 1UL << (i % 64), __ATOMIC_RELAXED);
+    else __atomic_fetch_and(&s->slab_map[i / 64], ~(1UL << (i % 64)), __ATOMIC_RELAXED);
+}
+
+//ptr 所在的段: 每个 arena 的段都是自己的 region，比较地址范围就行，段里记着它的 arena。
+//不在任何 arena 里（大块的映射）返回 NULL。先只看各个 arena 的段 0，通常每个 arena 只有这一个段
+static segment_t *seg_of(void *ptr){
+    int j;
+    for(int i = 0; i < NARENAS; i++)
+        if(in_seg(&arenas[i].seg[0], ptr)) return &arenas[i].seg[0];
+    for(int i = 0; i < NARENAS; i++)
+        if((j = seg_index(&arenas[i], ptr)) > 0) return &arenas[i].seg[j];
+    return NULL;
+}
+
+static inline arena_t *arena_of(void *ptr){
+    segment_t *s = seg_of(ptr);
+    return s == NULL ? NULL : s->arena;
+}
+
+static inline slab_t *slab_at(word_t off){
+    return off == 0 ? NULL : (slab_t *)from_handle(off);
+}
+
+static inline word_t slab_off(slab_t *s){
+    return s == NULL ? 0 : to_handle(s);
+}
+
+static void slab_link(slab_t *s){
+    int c = SLAB_CLASS(s->size);
+    s->prev = 0;
+    s->next = slab_off(arena->slabs[c]);
+    if(s->next != 0) slab_at(s->next)->prev = slab_off(s);
+    arena->slabs[c] = s;
+}
+
+static void slab_unlink(slab_t *s){
+    int c = SLAB_CLASS(s->size);
+    if(s->prev != 0) slab_at(s->prev)->next = s->next;
+    else arena->slabs[c] = slab_at(s->next);
+    if(s->next != 0) slab_at(s->next)->prev = s->prev;
+}
+
+//从堆里切一个按页对齐的块做成 size 字节对象的 slab 页
+static slab_t *slab_new(size_t size){
+    slab_t *s;
+    int i;
+    if((s = alloc_aligned_block(ADJUST_SIZE(SLAB_PAGE), SLAB_PAGE)) == NULL) return NULL;
+    s->size = size;
+    s->first = ALIGN(sizeof(slab_t));
+    s->nobjs = s->nfree = (SLAB_PAGE - s->first) / size;
+    memset(s->used, 0, sizeof(s->used));
+    for(i = s->nobjs; i < SLAB_WORDS * 64; i++) s->used[i / 64] |= 1UL << (i % 64);
+    slab_mark(s, 1);
+    slab_link(s);
+    return s;
+}
+
+static void *slab_alloc(size_t size){
+    slab_t *s;
+    int w, i;
+    if(arena->heap_listp == 0 && arena_init() < 0) return NULL;
+    size = ALIGN(size);
+    if((s = arena->slabs[SLAB_CLASS(size)]) == NULL && (s = slab_new(size)) == NULL) return NULL;
+    for(w = 0; ~s->used[w] == 0; w++);
+    i = w * 64 + __builtin_ctzl(~s->used[w]);
+    s->used[w] |= 1UL << (i % 64);
+    if(--s->nfree == 0) slab_unlink(s);
+    return (char *)s + s->first + i * s->size;
+}
+
+//页空了就还给堆，但每类至少留一页，免得在一个对象上反复建页拆页
+static void slab_free(void *ptr){
+    slab_t *s = SLAB_OF(ptr);
+    int i = ((char *)ptr - (char *)s - s->first) / s->size;
+    s->used[i / 64] &= ~(1UL << (i % 64));
+    if(s->nfree++ == 0) slab_link(s);
+    if(s->nfree == s->nobjs && (s->prev != 0 || s->next != 0)){
+        slab_unlink(s);
+        slab_mark(s, 0);
+        free_block(s);
+    }
+}
+
+#ifdef THREAD_SAFE
+static pthread_key_t thread_key; //线程退出时把缓存还回去、减掉 arena 的线程数
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static void thread_exit(void *arg);
+
+static void thread_key_init(void){
+    for(int i = 0; i < NARENAS; i++) pthread_mutex_init(&arenas[i].lock, NULL);
+    pthread_key_create(&thread_key, thread_exit);
+}
+
+//线程第一次分配时分到线程数最少的 arena，一样多时取编号最小的，相当于轮流分配
+static arena_t *thread_arena(void){
+    int best = 0;
+    if(home_arena != NULL) return home_arena;
+    pthread_once(&thread_once, thread_key_init);
+    pthread_mutex_lock(&arenas_lock);
+    for(int i = 1; i < NARENAS; i++)
+        if(arenas[i].nthreads < arenas[best].nthreads) best = i;
+    arenas[best].nthreads++;
+    pthread_mutex_unlock(&arenas_lock);
+    home_arena = &arenas[best];
+    pthread_setspecific(thread_key, home_arena);
+    return home_arena;
+}
+
+
+
+//把 first..last 这一串块（用载荷串起来）压进 a 的远程释放栈。
+//多个线程可以同时压入，只有持有 a 的锁的线程整个取走，所以没有 ABA 问题。
+static void remote_push(arena_t *a, void *first, void *last){
+    void *head = __atomic_load_n(&a->remote_free, __ATOMIC_RELAXED);
+    do {
+        *(void **)last = head;
+    } while(!__atomic_compare_exchange_n(&a->remote_free, &head, first, 1,
+                                         __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//持有当前 arena 的锁时调用: 取走别的线程压进来的块，一起释放
+static void remote_drain(void){
+    void *list;
+    if(__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED) == NULL) return;
+    list = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+    while(list != NULL){
+        void *bp = list;
+        list = *(void **)bp;
+        if(is_slab(seg_in(arena, bp), bp)) slab_free(bp);
+        else free_block(bp);
+    }
+}
+
+//块属于别的 arena 时不去抢它的锁，压进它的远程释放栈，等它下次分配时再释放
+static inline int is_remote(arena_t *owner){
+    return owner != home_arena && __atomic_load_n(&remote_free_on, __ATOMIC_RELAXED);
+}
+
+//把用载荷串起来的 list 上的块还给各自的 arena，连着属于同一个 arena 的一段只加一次锁
+static void free_list_to_owners(void *list){
+    while(list != NULL){
+        arena_t *owner = arena_of(list);
+        void *first = list, *last = list, *bp;
+        while(*(void **)last != NULL && arena_of(*(void **)last) == owner) last = *(void **)last;
+        list = *(void **)last;
+        if(is_remote(owner)){
+            remote_push(owner, first, last);
+            continue;
+        }
+        arena = owner;
+        LOCK();
+        do {
+            bp = first;
+            first = *(void **)bp;
+            free_block(bp);
+        } while(bp != last);
+        UNLOCK();
+    }
+}
+
+//线程退出前把自己 arena 的远程释放栈清掉，免得没有别的线程再从这个 arena 分配
+static void home_drain(arena_t *home){
+    arena = home;
+    LOCK();
+    if(arena->heap_listp != 0) remote_drain();
+    UNLOCK();
+}
+#endif
+
+#if defined(THREAD_SAFE) && !defined(PERCPU)
+//把 c 类缓存里的前 n 个块还给它们所属的 arena
+static void tcache_flush(int c, int n){
+    void *list = tcache[c];
+    void **tail = &tcache[c];
+    if(n > tcache_count[c]) n = tcache_count[c];
+    if(n <= 0) return;
+    for(int i = 0; i < n; i++) tail = (void **)*tail;
+    tcache[c] = *tail;
+    *tail = NULL;
+    tcache_count[c] -= n;
+    free_list_to_owners(list);
+}
+
+//当前线程缓存的块全部还给各自的 arena
+static void cache_flush(void){
+    if(tcache_gen == __atomic_load_n(&heap_gen, __ATOMIC_RELAXED))
+        for(int c = 0; c < TCACHE_CLASSES; c++) tcache_flush(c, tcache_count[c]);
+}
+
+static void thread_exit(void *arg){
+    arena_t *home = arg;
+    cache_flush();
+    home_drain(home);
+    pthread_mutex_lock(&arenas_lock);
+    home->nthreads--;
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+//线程第一次使用缓存，或者堆被 mm_init 重置过: 清空缓存
+static void tcache_reset(unsigned long gen){
+    thread_arena(); //注册线程退出时的清理
+    memset(tcache, 0, sizeof(tcache));
+    memset(tcache_count, 0, sizeof(tcache_count));
+    tcache_gen = gen;
+}
+
+static void *cache_get(size_t asize){
+    int c = (asize - MINBLOCKSIZE) / GRAIN;
+    unsigned long gen = __atomic_load_n(&heap_gen, __ATOMIC_RELAXED);
+    void *bp;
+    if(tcache_gen != gen) tcache_reset(gen);
+    if((bp = tcache[c]) != NULL){
+        tcache[c] = *(void **)bp;
+        tcache_count[c]--;
+        return bp;
+    }
+    //缓存空了: 一次加锁从自己的 arena 拿一批
+    arena = thread_arena();
+    LOCK();
+    bp = alloc_block(asize);
+    for(int i = 1; bp != NULL && i < TCACHE_BATCH; i++){
+        void *extra = alloc_block(asize);
+        if(extra == NULL) break;
+        *(void **)extra = tcache[c];
+        tcache[c] = extra;
+        tcache_count[c]++;
+    }
+    UNLOCK();
+    return bp;
+}
+
+//放进线程缓存，不能缓存的块返回 0。
+//不加锁读头部是安全的: 别的线程只会在持锁时改这个头部的 prealloc 位，大小不会变。
+static int cache_put(void *ptr){
+    size_t size = GET_SIZE(HDRP(ptr));
+    unsigned long gen = __atomic_load_n(&heap_gen, __ATOMIC_RELAXED);
+    //slack 表里的块可能被切小，不能按现在的大小缓存
+    if(size > TCACHE_MAX || GET_GROWN(HDRP(ptr))) return 0;
+    if(tcache_gen != gen) tcache_reset(gen);
+    int c = (size - MINBLOCKSIZE) / GRAIN;
+    if(tcache_count[c] >= TCACHE_LIMIT) tcache_flush(c, TCACHE_LIMIT / 2);
+    *(void **)ptr = tcache[c];
+    tcache[c] = ptr;
+    tcache_count[c]++;
+    return 1;
+}
+#elif defined(PERCPU)
+//rseq 临界区的描述符放在 __rseq_cs 段，abort 入口前面是注册时约定的签名
+#define RSEQ_CS_ENTER \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %[rseq_cs]\n\t" \
+    "1:\n\t" \
+    "cmpl %[cpu], %[cur_cpu]\n\t" \
+    "jnz %l[abort]\n\t"
+#define RSEQ_CS_ABORT \
+    "2:\n\t" \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    "4:\n\t" \
+    "jmp %l[abort]\n\t" \
+    ".popsection\n\t"
+
+static inline struct rseq *rseq_area(void){
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+//还在 cpu 上并且 *v == expect 时令 *v = newv。成功返回 0，被打断或 *v 变了返回 1
+static inline int rseq_cmpeqv_storev(struct rseq *rs, void **v, void *expect, void *newv, int cpu){
+    __asm__ __volatile__ goto(
+        RSEQ_CS_ENTER
+        "cmpq %[v], %[expect]\n\t"
+        "jnz %l[abort]\n\t"
+        "movq %[newv], %[v]\n\t"
+        RSEQ_CS_ABORT
+        : /* no outputs */
+        : [cpu] "r" (cpu), [cur_cpu] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+          [v] "m" (*v), [expect] "r" (expect), [newv] "r" (newv)
+        : "memory", "cc", "rax"
+        : abort);
+    return 0;
+abort:
+    return 1;
+}
+
+//还在 cpu 上时弹出链表 *v 的头放进 *res。成功返回 0，被打断返回 1，链表为空返回 -1
+static inline int rseq_pop(struct rseq *rs, void **v, void **res, int cpu){
+    __asm__ __volatile__ goto(
+        RSEQ_CS_ENTER
+        "movq %[v], %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[empty]\n\t"
+        "movq %%rcx, %[res]\n\t"
+        "movq (%%rcx), %%rcx\n\t"
+        "movq %%rcx, %[v]\n\t"
+        RSEQ_CS_ABORT
+        : /* no outputs */
+        : [cpu] "r" (cpu), [cur_cpu] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs),
+          [v] "m" (*v), [res] "m" (*res)
+        : "memory", "cc", "rax", "rcx"
+        : abort, empty);
+    return 0;
+abort:
+    return 1;
+empty:
+    return -1;
+}
+
+//当前 CPU，rseq 不可用或 CPU 太多时返回 -1，调用者直接用中心堆
+static inline int current_cpu(struct rseq *rs){
+    int cpu = (int)*(volatile unsigned int *)&rs->cpu_id_start;
+    return (__rseq_size == 0 || cpu >= MAX_CPUS) ? -1 : cpu;
+}
+
+static void *percpu_pop(struct rseq *rs, int c){
+    void *bp = NULL;
+    int cpu, ret;
+    do {
+        if((cpu = current_cpu(rs)) < 0) return NULL;
+        ret = rseq_pop(rs, &cpu_cache[cpu].head[c], &bp, cpu);
+    } while(ret > 0);
+    return ret == 0 ? bp : NULL;
+}
+
+//从当前 CPU 的 c 类缓存里拿 n 个块还给中心堆
+static void percpu_flush(struct rseq *rs, int c, int n){
+    void *list = NULL, *bp;
+    while(n-- > 0 && (bp = percpu_pop(rs, c)) != NULL){
+        *(void **)bp = list;
+        list = bp;
+    }
+    free_list_to_owners(list);
+}
+
+//压进当前 CPU 的缓存，rseq 不可用时返回 0
+static int percpu_push(struct rseq *rs, int c, void *bp){
+    int cpu;
+    for(;;){
+        if((cpu = current_cpu(rs)) < 0) return 0;
+        void **headp = &cpu_cache[cpu].head[c];
+        void *head = *(void * volatile *)headp;
+        //head 可能已经被别的线程拿走，读到的长度不准也没关系，只是个阈值
+        unsigned int count = head == NULL ? 1 : NODE_COUNT(head) + 1;
+        if(count > TCACHE_LIMIT){
+            percpu_flush(rs, c, TCACHE_LIMIT / 2);
+            continue;
+        }
+        *(void **)bp = head;
+        NODE_COUNT(bp) = count;
+        if(rseq_cmpeqv_storev(rs, headp, head, bp, cpu) == 0) return 1;
+    }
+}
+
+static void *cache_get(size_t asize){
+    int c = (asize - MINBLOCKSIZE) / GRAIN;
+    struct rseq *rs = rseq_area();
+    void *bp, *extra[TCACHE_BATCH];
+    int n = 0;
+    if((bp = percpu_pop(rs, c)) != NULL) return bp;
+    //缓存空了（或者 rseq 不可用）: 一次加锁从自己的 arena 拿一批
+    arena = thread_arena();
+    LOCK();
+    bp = alloc_block(asize);
+    if(current_cpu(rs) >= 0)
+        for(n = 0; bp != NULL && n < TCACHE_BATCH - 1; n++)
+            if((extra[n] = alloc_block(asize)) == NULL) break;
+    UNLOCK();
+    for(int i = 0; i < n; i++){
+        if(!percpu_push(rs, c, extra[i])){
+            *(void **)extra[i] = NULL;
+            free_list_to_owners(extra[i]);
+        }
+    }
+    return bp;
+}
+
+//放进当前 CPU 的缓存，不能缓存的块返回 0
+static int cache_put(void *ptr){
+    size_t size = GET_SIZE(HDRP(ptr));
+    //slack 表里的块可能被切小，不能按现在的大小缓存
+    if(size > TCACHE_MAX || GET_GROWN(HDRP(ptr))) return 0;
+    return percpu_push(rseq_area(), (size - MINBLOCKSIZE) / GRAIN, ptr);
+}
+
+//当前 CPU 缓存的块全部还给各自的 arena
+static void cache_flush(void){
+    struct rseq *rs = rseq_area();
+    for(int c = 0; c < TCACHE_CLASSES; c++) percpu_flush(rs, c, INT_MAX);
+}
+
+static void thread_exit(void *arg){
+    arena_t *home = arg;
+    home_drain(home);
+    pthread_mutex_lock(&arenas_lock);
+    home->nthreads--;
+    pthread_mutex_unlock(&arenas_lock);
+}
+#endif
+
+void free(void *ptr){
+    segment_t *s;
+    arena_t *owner;
+    int slab;
+    //ptr为空指针，直接返回
+    //printf("free %p\n", ptr);
+    if(ptr == NULL) return;
+    if((s = seg_of(ptr)) == NULL){
+        huge_free(ptr);
+        return;
+    }
+    owner = s->arena;
+    //slab 对象没有头部，不能进按块大小分类的线程缓存
+    slab = is_slab(s, ptr);
+#ifdef THREAD_SAFE
+    if(!slab && cache_put(ptr)) return;
+#endif
+    //还给块所属的 arena
+    arena = owner;
+#ifdef THREAD_SAFE
+    if(is_remote(arena)){
+        remote_push(arena, ptr, ptr);
+        return;
+    }
+#endif
+    LOCK();
+    arena->ops++;
+    if(slab) slab_free(ptr);
+    else free_block(ptr);
+    auto_trim();
+    purge_decayed(0);
+    UNLOCK();
+}
+
 /*
 void mm_free(void *ptr)
 {
@@ -378,10 +1855,56 @@ void mm_free(void *ptr)
 }
 */
 
+//把已分配块 bp 的尾部 [asize, size) 切成一个空闲块，太小就不切
+static void split_tail(void *bp, size_t asize){
+    size_t size = GET_SIZE(HDRP(bp));
+    if(size - asize < MINBLOCKSIZE) return;
+    arena->stats.splits++;
+    PUT(HDRP(bp), PACK(asize, GET_PREALLOC(HDRP(bp)), 1) | GET_GROWN(HDRP(bp)));
+    void *tail = NEXT_BLKP(bp);
+    PUT(HDRP(tail), PACK(size - asize, 1, 0));
+    PUT(FTRP(tail), PACK(size - asize, 1, 0));
+    SET_PREV(tail, 0); SET_NEXT(tail, 0);
+    //tail 后面的块如果已分配，它的 prealloc 位要清掉；如果空闲，coalesce 会合并并重写
+    set_next_prealloc(tail, 0);
+    coalesce(tail);
+}
+
+//原地调整 ptr 的大小：缩小时切掉尾部；增大时吞掉后面的空闲块，
+//ptr 在堆顶时先把堆扩展到够用。做不到返回 NULL，由调用者拷贝。
+static void *realloc_in_place(void *ptr, size_t asize){
+    size_t size = GET_SIZE(HDRP(ptr));
+    void *next = NEXT_BLKP(ptr);
+    size_t next_size = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+
+    if(asize <= size){
+        fresh_raise(ptr);
+        split_tail(ptr, asize);
+        return ptr;
+    }
+    //后面是结尾块，或者是紧挨着结尾块的空闲块：只扩展差的那一部分。
+    //extend_heap 只长当前段，旧段末尾的块长不了
+    if(size + next_size < asize && GET_SIZE(HDRP((char *)next + next_size)) == 0 && in_cur_seg(ptr)){
+        size_t shortfall = MAX(asize - size - next_size, MINBLOCKSIZE);
+        if(extend_heap(shortfall / WSIZE) == NULL) return NULL;
+        next_size = GET_SIZE(HDRP(next));
+    }
+    if(size + next_size < asize) return NULL;
+    //吞掉后面的空闲块，多出来的部分再切回去
+    remove_from_free_list(next);
+    PUT(HDRP(ptr), PACK(size + next_size, GET_PREALLOC(HDRP(ptr)), 1) | GET_GROWN(HDRP(ptr)));
+    set_next_prealloc(ptr, 1);
+    split_tail(ptr, asize);
+    return ptr;
+}
+
 void *realloc(void *ptr, size_t size)
 {
-    size_t oldsize;
+    size_t oldsize, asize, newsize, grown;
+    segment_t *seg;
+    int slab;
     void *newptr;
+    slack_t *s;
     if(size == 0) {
         free(ptr);
         return 0;
@@ -389,24 +1912,191 @@ void *realloc(void *ptr, size_t size)
     if(ptr == NULL) {
         return malloc(size);
     }
-    newptr = malloc(size);
+    if((seg = seg_of(ptr)) == NULL) return huge_realloc(ptr, size);
+    arena = seg->arena;
+    slab = is_slab(seg, ptr);
+    //长到阈值以上就搬进单独的映射，以后的增长都不用再拷贝
+    if(huge_wanted(size) && (newptr = huge_alloc(size)) != NULL) {
+        oldsize = slab ? SLAB_OF(ptr)->size : GET_SIZE(HDRP(ptr)) - WSIZE;
+        memcpy(newptr, ptr, MIN(size, oldsize));
+        free(ptr);
+        return newptr;
+    }
+    asize = ADJUST_SIZE(size);
+    //slab 对象: 还在同一类就不动，否则重新分配再拷贝
+    if(slab) {
+        oldsize = SLAB_OF(ptr)->size;
+        if(slab_eligible(size) && ALIGN(size) == oldsize) return ptr;
+        if((newptr = malloc(size)) == NULL) return 0;
+        memcpy(newptr, ptr, MIN(size, oldsize));
+        free(ptr);
+        return newptr;
+    }
+    LOCK();
+    oldsize = GET_SIZE(HDRP(ptr));
+    grown = GET_GROWN(HDRP(ptr));
+    if(grown && (s = find_slack(ptr)) != NULL) {
+        //预留的空间够用，省掉一次拷贝
+        if(asize <= oldsize) {
+            if(asize > s->used) arena->stats.slack_hits++;
+            s->used = asize;
+            UNLOCK();
+            return ptr;
+        }
+        s->bp = NULL;
+    }
+    if(realloc_in_place(ptr, asize) != NULL) {
+        if(asize > oldsize) PUT(HDRP(ptr), GET(HDRP(ptr)) | GROWN);
+        UNLOCK();
+        return ptr;
+    }
+    //已经增长过又要搬家: 按几何增长多分配，之后的增长就能原地完成
+    newsize = grown ? REALLOC_GROWTH(asize) : asize;
+    newptr = alloc_block(newsize);
     if(!newptr) {
+        UNLOCK();
         return 0;
     }
-    oldsize = GET_SIZE(HDRP(ptr));
+    arena->stats.realloc_copies++;
+    oldsize -= WSIZE;
     if(size < oldsize) oldsize = size;
     memcpy(newptr, ptr, oldsize);
     /* Free the old block. */
-    free(ptr);
+    free_block(ptr);
+    PUT(HDRP(newptr), GET(HDRP(newptr)) | GROWN);
+    if(newsize > asize) add_slack(newptr, asize);
+    UNLOCK();
     return newptr;
 }
+//calloc 从 bp 分到的块: 从返回的地址起到块尾都已经是 0（最后的 DSIZE 字节除外）
+static char *fresh_from(char *bp){
+    char *end = bp + GET_SIZE(HDRP(bp)) - WSIZE;
+    if(!in_cur_seg(bp) || arena->fresh >= end) return end;
+    return MAX(arena->fresh, bp + DIRTY_END);
+}
+
+//只清可能写过的部分: 新映射的大块不清，从没用过的堆内存只清块开头的链表指针和块尾
 void *calloc (size_t nmemb, size_t size){
     //printf("[Start] Calloc\n");
-    size_t total_size = nmemb * size;
-    void *newptr = malloc(total_size);
-    memset(newptr, 0, total_size);
-    return newptr;
+    size_t total_size, adjust_size;
+    char *bp, *clean = NULL, *end = NULL, *lim, *tail;
+    if(size != 0 && nmemb > (size_t)-1 / size) return NULL;
+    total_size = nmemb * size;
+    if(total_size == 0) return NULL;
+    if(huge_wanted(total_size) && (bp = huge_alloc(total_size)) != NULL) return bp;
+    adjust_size = ADJUST_SIZE(total_size);
+    //小块可能来自 quick list、线程缓存或者 slab，都被用过，整块清零
+    if(adjust_size <= QUICK_MAX){
+        if((bp = malloc(total_size)) != NULL) memset(bp, 0, total_size);
+        return bp;
+    }
+    arena = thread_arena();
+    LOCK();
+    if((bp = alloc_block(adjust_size)) != NULL){
+        clean = fresh_from(bp);
+        end = bp + GET_SIZE(HDRP(bp)) - WSIZE;
+    }
+    UNLOCK();
+    if(bp == NULL) return NULL;
+    lim = bp + total_size;
+    memset(bp, 0, MIN(clean, lim) - bp);
+    //整个拿走的空闲块，最后一个字是它原来的尾部
+    tail = MAX(end - DSIZE, clean);
+    if(lim > tail) memset(tail, 0, lim - tail);
+    return bp;
+}
+//对齐到 alignment（2 的幂）的块: 多要 alignment 字节，前面对不齐的部分切成空闲块还回去
+void *memalign(size_t alignment, size_t size){
+    char *bp;
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0){
+        errno = EINVAL;
+        return NULL;
+    }
+    if(alignment <= ALIGNMENT) return malloc(size);
+    if(size == 0) return NULL;
+    //映射的载荷在页头之后 HUGE_HDR 字节，更大的对齐只能从堆里分
+    if(huge_wanted(size) && HUGE_HDR % alignment == 0 && (bp = huge_alloc(size)) != NULL) return bp;
+    if(size >= MAX_HEAP || alignment >= MAX_HEAP){
+        errno = ENOMEM;
+        return NULL;
+    }
+    arena = thread_arena();
+    LOCK();
+    bp = alloc_aligned_block(ADJUST_SIZE(size), alignment);
+    UNLOCK();
+    if(bp == NULL) errno = ENOMEM;
+    return bp;
+}
+
+void *aligned_alloc(size_t alignment, size_t size){
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size){
+    void *bp;
+    if(alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+    if((bp = memalign(alignment, size)) == NULL && size != 0) return ENOMEM;
+    *memptr = bp;
+    return 0;
+}
+
+void mm_set_remote_free(int enable){
+#ifdef THREAD_SAFE
+    __atomic_store_n(&remote_free_on, enable, __ATOMIC_RELAXED);
+#else
+    (void)enable;
+#endif
+}
+
+void mm_get_params(mm_params_t *p){
+    *p = params;
+}
+
+void mm_set_params(const mm_params_t *p){
+    params = *p;
+}
+
+void mm_set_quick_lists(int enable){
+    __atomic_store_n(&quick_on, enable, __ATOMIC_RELAXED);
 }
+
+void mm_getstats(mm_stats_t *st){
+    const mm_stats_t *a;
+    memset(st, 0, sizeof(*st));
+    for(int i = 0; i < NARENAS; i++){
+        a = &arenas[i].stats;
+        st->searches += a->searches;
+        st->search_steps += a->search_steps;
+        st->max_steps = MAX(st->max_steps, a->max_steps);
+        st->max_bins = MAX(st->max_bins, a->max_bins);
+        st->realloc_copies += a->realloc_copies;
+        st->slack_hits += a->slack_hits;
+        st->slack_released += a->slack_released;
+        st->coalesces += a->coalesces;
+        st->splits += a->splits;
+        st->quick_hits += a->quick_hits;
+        st->heap_extends += a->heap_extends;
+        st->heap_trims += a->heap_trims;
+        st->trimmed += a->trimmed;
+        st->purges += a->purges;
+        st->purged += a->purged;
+        st->segments = MAX(st->segments, a->segments);
+    }
+    st->huge_maps = huge_maps;
+    st->huge_remaps = huge_remaps;
+}
+
+#ifndef TLSF
+//中序打印大块树，缩进表示深度
+static void print_tree(void *bp, int depth){
+    if(bp == NULL) return;
+    print_tree(GET_LEFT(bp), depth + 1);
+    printf("%*s%p\t", 2 * depth, "", bp);
+    printf("size:%zu\n", GET_SIZE(HDRP(bp)));
+    print_tree(GET_RIGHT(bp), depth + 1);
+}
+#endif
+
 void mm_checkheap(int verbose){
     verbose = verbose;
     /*Get gcc to be quiet. */
@@ -414,9 +2104,9 @@ void mm_checkheap(int verbose){
     if(verbose == 1){
         /*
         printf("[Start] mm_checkheap=========================================================================\n");
-        for(void *bp = free_list_head; bp != NULL; bp = GET_NEXT(bp)){
+        for(void *bp = arena->free_lists[0]; bp != NULL; bp = GET_NEXT(bp)){
             printf("%p\t", bp);
-            printf("size:%d\t", GET_SIZE(HDRP(bp)));
+            printf("size:%zu\t", GET_SIZE(HDRP(bp)));
             printf("prev:%p\t", GET_PREV(bp));
             printf("next:%p\n", GET_NEXT(bp));
         }
@@ -427,25 +2117,36 @@ void mm_checkheap(int verbose){
     if(verbose == 2){
 
         printf("[Start] Check heap========================================================================\n");
-        for(void *bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)){
-            printf("%p\t\t", bp);
-            printf("size:%d\t\t", GET_SIZE(HDRP(bp)));
-            printf("alloc:%d\n", GET_ALLOC(HDRP(bp)));
-            //printf("prev:%p\t", GET_PREV(bp));
-            //printf("next:%p\n", GET_NEXT(bp));
+        for(int i = 0; i < arena->nsegs; i++){
+            if(i > 0) printf("segment %d:\n", i);
+            for(void *bp = i == 0 ? arena->heap_listp : arena->seg[i].lo + SEG_MAP_BYTES + DSIZE; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)){
+                printf("%p\t\t", bp);
+                printf("size:%zu\t\t", GET_SIZE(HDRP(bp)));
+                printf("alloc:%d\n", (int)GET_ALLOC(HDRP(bp)));
+                //printf("prev:%p\t", GET_PREV(bp));
+                //printf("next:%p\n", GET_NEXT(bp));
+            }
         }
         printf("[End] Check heap========================================================================\n");
 
         //check linked list:
         printf("[Start] Check linked list======================================================================\n");
-        printf("heap_listp:%p\n", heap_listp);
-        printf("heap_bound:%p\n", heap_listp + mem_heapsize());
-        for(void *bp = free_list_head; bp != NULL; bp = GET_NEXT(bp)){
-            printf("%p\t", bp);
-            printf("size:%d\t", GET_SIZE(HDRP(bp)));
-            printf("prev:%p\t", GET_PREV(bp));
-            printf("next:%p\n", GET_NEXT(bp));
+        printf("arena->heap_listp:%p\n", arena->heap_listp);
+        printf("heap_bound:%p\n", arena->heap_listp + mem_heapsize());
+        for(int c = 0; c < NUM_CLASSES; c++){
+            if(arena->free_lists[c] != NULL) printf("class %d:\n", c);
+            for(void *bp = arena->free_lists[c]; bp != NULL; bp = GET_NEXT(bp)){
+                printf("%p\t", bp);
+                printf("size:%zu\t", GET_SIZE(HDRP(bp)));
+                printf("prev:%p\t", GET_PREV(bp));
+                printf("next:%p\n", GET_NEXT(bp));
+            }
         }
+        if(arena->top != NULL) printf("top:\n%p\tsize:%zu\n", arena->top, GET_SIZE(HDRP(arena->top)));
+#ifndef TLSF
+        if(arena->free_tree != NULL) printf("tree:\n");
+        print_tree(arena->free_tree, 0);
+#endif
         printf("[End] Check linked list========================================================================\n");
         printf("\n\n");
     }
@@ -7,6 +7,9 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign (size_t alignment, size_t size);
+extern void *mm_aligned_alloc (size_t alignment, size_t size);
+extern int mm_posix_memalign (void **memptr, size_t alignment, size_t size);
 
 #else
 
@@ -15,11 +18,80 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign (size_t alignment, size_t size);
+extern void *aligned_alloc (size_t alignment, size_t size);
+extern int posix_memalign (void **memptr, size_t alignment, size_t size);
 
 #endif
 
 extern int mm_init(void);
 
+/* Allocator statistics for the current trace, reset by mm_init. */
+typedef struct {
+    unsigned long searches;       /* number of free-list fit searches */
+    unsigned long search_steps;   /* free blocks examined by all searches */
+    unsigned long max_steps;      /* most free blocks examined by one search */
+    unsigned long max_bins;       /* most size classes probed by one search */
+    unsigned long realloc_copies; /* reallocs that moved the block */
+    unsigned long slack_hits;     /* reallocs grown into reserved slack, no copy */
+    unsigned long slack_released; /* bytes of slack given back to free lists */
+    unsigned long coalesces;      /* merges of a freed block with a free neighbour */
+    unsigned long splits;         /* blocks split by malloc or realloc */
+    unsigned long quick_hits;     /* mallocs served from a quick list, no search */
+    unsigned long heap_extends;   /* mem_sbrk calls that grew the heap */
+    unsigned long heap_trims;     /* mem_sbrk calls that shrank the heap */
+    unsigned long trimmed;        /* bytes given back by those calls */
+    unsigned long purges;         /* free blocks whose interior pages were purged */
+    unsigned long purged;         /* bytes of those pages */
+    unsigned long huge_maps;      /* huge blocks given their own mapping */
+    unsigned long huge_remaps;    /* reallocs that resized such a mapping, no copy */
+    unsigned long segments;       /* most heap segments one arena used */
+} mm_stats_t;
+
+extern void mm_getstats(mm_stats_t *stats);
+
+/* Heap growth policy. When no free block fits, the heap grows by what
+   the free block at the top of the heap is short of. While extensions
+   come within grow_window allocations of each other the heap grows by
+   at least a chunk that doubles from grow_min up to grow_max; when they
+   do not, the chunk halves and drops to zero below grow_min. The chunk
+   is also kept under 1/32 of the heap, so small heaps stay small.
+   A free that leaves more than trim_threshold bytes free at the top of
+   the heap shrinks the heap, keeping top_pad bytes of it. Whole pages
+   inside a free block that stays free for purge_decay allocations and
+   frees are given back to the system; the block itself stays in place.
+   Requests of mmap_threshold bytes or more get a mapping of their own,
+   which free unmaps and realloc resizes with mremap instead of copying. */
+typedef struct {
+    size_t grow_min;           /* first chunk of a burst; 0 grows by the shortfall only */
+    size_t grow_max;           /* largest chunk */
+    unsigned long grow_window; /* allocations between extensions that count as a burst */
+    size_t trim_threshold;     /* free top size that triggers a trim; 0 never trims */
+    size_t top_pad;            /* bytes of the free top kept by an automatic trim */
+    unsigned long purge_decay; /* operations before free pages are purged; 0 never purges */
+    size_t mmap_threshold;     /* smallest request mapped on its own; 0 never maps */
+} mm_params_t;
+
+extern void mm_get_params(mm_params_t *params);
+extern void mm_set_params(const mm_params_t *params);
+
+/* Shrink every arena's heap so that at most pad bytes stay free at the
+   top, and purge the free pages still waiting out purge_decay. Returns
+   1 if any memory was given back, 0 otherwise. */
+extern int mm_trim(size_t pad);
+
+/* Give the growth slack reserved behind realloc'd blocks back to the heap. */
+extern void mm_release_slack(void);
+
+/* Thread-safe build: when enabled (the default), freeing a block owned by
+   another thread's arena pushes it onto that arena's lock-free queue instead
+   of taking the arena lock; the owner frees it on its next malloc. */
+extern void mm_set_remote_free(int enable);
+
+/* When enabled (the default), freed small blocks wait on per-size quick
+   lists and are coalesced in bulk; disable to coalesce on every free. */
+extern void mm_set_quick_lists(int enable);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
@@ -0,0 +1,311 @@
+/*
+ * mtbench.c - multi-threaded small-object benchmark for mm.c
+ *
+ * Each thread keeps a private working set of WORKSET slots and runs a
+ * random malloc/free mix over it, mostly small sizes that hit the
+ * per-thread or per-CPU caches. For every thread count it reports the
+ * CPU time per operation, the wall-clock throughput, and the memory
+ * overhead (peak heap size over the bytes still live at the end of the
+ * run).
+ *
+ * With -p each thread count is a number of producer/consumer pairs: the
+ * producer allocates blocks and hands them over a ring to its consumer,
+ * which frees them. Every count runs twice, with the remote-free queues
+ * of the thread-safe build turned on and off, so the cost of freeing
+ * blocks that belong to another thread's arena can be compared.
+ *
+ * Built three ways by the Makefile:
+ *   mtbench         single-threaded mm.c (only -t 1 is allowed)
+ *   mtbench-mt      -DTHREAD_SAFE, per-thread caches
+ *   mtbench-percpu  -DTHREAD_SAFE -DPERCPU, per-CPU rseq caches
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define WORKSET   1024   /* live slots per thread */
+#define MAXTHREADS 256
+#define DEFAULT_OPS 200000 /* operations per thread */
+#define RING      256    /* blocks in flight between a producer and its consumer */
+
+typedef struct {
+	pthread_t tid;
+	unsigned int seed;
+	long ops;
+	size_t live;       /* payload bytes still allocated at the end */
+	double cpu_ns;     /* thread CPU time spent in the loop */
+} worker_t;
+
+/* Single-producer, single-consumer ring of blocks */
+typedef struct {
+	void *slot[RING];
+	unsigned long head;  /* next slot the producer fills */
+	unsigned long tail;  /* next slot the consumer empties */
+} ring_t;
+
+typedef struct {
+	worker_t producer;
+	worker_t consumer;
+	ring_t ring;
+} pair_t;
+
+static pthread_barrier_t start_barrier;
+
+static double ts_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1e9 + ts->tv_nsec;
+}
+
+/* Mostly 1..256 bytes, one request in 32 up to 4 KB */
+static size_t pick_size(unsigned int *seed)
+{
+	if (rand_r(seed) % 32 == 0)
+		return rand_r(seed) % 4096 + 1;
+	return rand_r(seed) % 256 + 1;
+}
+
+static void *worker(void *arg)
+{
+	worker_t *w = arg;
+	char *slot[WORKSET];
+	size_t size[WORKSET];
+	struct timespec t0, t1;
+	long i;
+	int j;
+
+	memset(slot, 0, sizeof(slot));
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+	for (i = 0; i < w->ops; i++) {
+		j = rand_r(&w->seed) % WORKSET;
+		if (slot[j] != NULL) {
+			mm_free(slot[j]);
+			slot[j] = NULL;
+		} else {
+			size[j] = pick_size(&w->seed);
+			slot[j] = mm_malloc(size[j]);
+			slot[j][0] = (char)j;
+		}
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+	w->cpu_ns = ts_ns(&t1) - ts_ns(&t0);
+
+	w->live = 0;
+	for (j = 0; j < WORKSET; j++)
+		if (slot[j] != NULL)
+			w->live += size[j];
+	pthread_barrier_wait(&start_barrier);
+	for (j = 0; j < WORKSET; j++)
+		mm_free(slot[j]);
+	return NULL;
+}
+
+static void *producer(void *arg)
+{
+	pair_t *p = arg;
+	worker_t *w = &p->producer;
+	struct timespec t0, t1;
+	unsigned long head = 0;
+	size_t size;
+	char *bp;
+	long i;
+
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+	for (i = 0; i < w->ops; i++) {
+		size = pick_size(&w->seed);
+		bp = mm_malloc(size);
+		bp[0] = bp[size - 1] = (char)i;
+		while (head - __atomic_load_n(&p->ring.tail, __ATOMIC_ACQUIRE) == RING)
+			sched_yield();
+		p->ring.slot[head % RING] = bp;
+		__atomic_store_n(&p->ring.head, ++head, __ATOMIC_RELEASE);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+	w->cpu_ns = ts_ns(&t1) - ts_ns(&t0);
+	pthread_barrier_wait(&start_barrier);
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	pair_t *p = arg;
+	worker_t *w = &p->consumer;
+	struct timespec t0, t1;
+	unsigned long tail = 0;
+	long i;
+
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t0);
+	for (i = 0; i < w->ops; i++) {
+		while (__atomic_load_n(&p->ring.head, __ATOMIC_ACQUIRE) == tail)
+			sched_yield();
+		mm_free(p->ring.slot[tail % RING]);
+		__atomic_store_n(&p->ring.tail, ++tail, __ATOMIC_RELEASE);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t1);
+	w->cpu_ns = ts_ns(&t1) - ts_ns(&t0);
+	pthread_barrier_wait(&start_barrier);
+	return NULL;
+}
+
+/*
+ * run - one round with nthreads threads on a fresh heap
+ */
+static void run(int nthreads, long ops)
+{
+	static worker_t w[MAXTHREADS];
+	struct timespec t0, t1;
+	double cpu_ns = 0, wall_ns;
+	size_t live = 0;
+	int i;
+
+	mem_reset_brk();
+	if (mm_init() < 0) {
+		fprintf(stderr, "mm_init failed\n");
+		exit(1);
+	}
+	pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		w[i].seed = i + 1;
+		w[i].ops = ops;
+		pthread_create(&w[i].tid, NULL, worker, &w[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_barrier_wait(&start_barrier);
+	/* second barrier: every thread has finished its timed loop */
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(w[i].tid, NULL);
+		cpu_ns += w[i].cpu_ns;
+		live += w[i].live;
+	}
+	pthread_barrier_destroy(&start_barrier);
+	wall_ns = ts_ns(&t1) - ts_ns(&t0);
+
+	printf("%8d%10.1f%12.2f%12lu%12lu%10.2f\n",
+			nthreads,
+			cpu_ns / (ops * nthreads),
+			ops * nthreads / wall_ns * 1e3,
+			(unsigned long)live / 1024,
+			(unsigned long)mem_peak_heapsize() / 1024,
+			(double)mem_peak_heapsize() / live);
+}
+
+/*
+ * run_pairs - one producer/consumer round with npairs pairs on a fresh
+ *     heap; each producer hands ops blocks to its consumer
+ */
+static void run_pairs(int npairs, long ops, int remote)
+{
+	static pair_t p[MAXTHREADS / 2];
+	struct timespec t0, t1;
+	double cpu_ns = 0, wall_ns;
+	int i;
+
+	mem_reset_brk();
+	if (mm_init() < 0) {
+		fprintf(stderr, "mm_init failed\n");
+		exit(1);
+	}
+	mm_set_remote_free(remote);
+	pthread_barrier_init(&start_barrier, NULL, 2 * npairs + 1);
+	for (i = 0; i < npairs; i++) {
+		memset(&p[i].ring, 0, sizeof(p[i].ring));
+		p[i].producer.seed = i + 1;
+		p[i].producer.ops = p[i].consumer.ops = ops;
+		pthread_create(&p[i].producer.tid, NULL, producer, &p[i]);
+		pthread_create(&p[i].consumer.tid, NULL, consumer, &p[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_barrier_wait(&start_barrier);
+	pthread_barrier_wait(&start_barrier);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (i = 0; i < npairs; i++) {
+		pthread_join(p[i].producer.tid, NULL);
+		pthread_join(p[i].consumer.tid, NULL);
+		cpu_ns += p[i].producer.cpu_ns + p[i].consumer.cpu_ns;
+	}
+	pthread_barrier_destroy(&start_barrier);
+	wall_ns = ts_ns(&t1) - ts_ns(&t0);
+
+	/* one op is a block passed from producer to consumer */
+	printf("%8d%8s%10.1f%12.2f%12lu\n",
+			npairs,
+			remote ? "on" : "off",
+			cpu_ns / (ops * npairs),
+			ops * npairs / wall_ns * 1e3,
+			(unsigned long)mem_peak_heapsize() / 1024);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: mtbench [-hp] [-n <ops>] [-t <n1,n2,...>]\n");
+	fprintf(stderr, "\t-n <ops>   Operations per thread (default %d).\n",
+			DEFAULT_OPS);
+	fprintf(stderr, "\t-p         Producer/consumer pairs, remote free on and off.\n");
+	fprintf(stderr, "\t-t <list>  Thread counts (pairs with -p) to run (default 1,8,64).\n");
+}
+
+int main(int argc, char **argv)
+{
+	char threads[256] = "1,8,64";
+	long ops = DEFAULT_OPS;
+	char *tok;
+	int c, n, pairs = 0;
+
+	while ((c = getopt(argc, argv, "n:pt:h")) != EOF) {
+		switch (c) {
+			case 'p':
+				pairs = 1;
+				break;
+			case 'n':
+				ops = atol(optarg);
+				break;
+			case 't':
+				snprintf(threads, sizeof(threads), "%s", optarg);
+				break;
+			case 'h':
+			default:
+				usage();
+				exit(c == 'h' ? 0 : 1);
+		}
+	}
+
+	mem_init();
+	if (pairs)
+		printf("%8s%8s%10s%12s%12s\n",
+				"pairs", "remote", "ns/op", "Mops/sec", "heap(KB)");
+	else
+		printf("%8s%10s%12s%12s%12s%10s\n",
+				"threads", "ns/op", "Mops/sec", "live(KB)", "heap(KB)",
+				"overhead");
+	for (tok = strtok(threads, ","); tok != NULL; tok = strtok(NULL, ",")) {
+		n = atoi(tok);
+		if (n < 1 || n > (pairs ? MAXTHREADS / 2 : MAXTHREADS)) {
+			fprintf(stderr, "bad thread count %s\n", tok);
+			exit(1);
+		}
+#ifndef THREAD_SAFE
+		if (n > 1 || pairs) {
+			printf("%8d  skipped: mm.c built without THREAD_SAFE\n", n);
+			continue;
+		}
+#endif
+		if (pairs) {
+			run_pairs(n, ops, 1);
+			run_pairs(n, ops, 0);
+		} else
+			run(n, ops);
+	}
+	mem_deinit();
+	return 0;
+}
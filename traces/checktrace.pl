@@ -89,6 +89,11 @@ while ($line = <STDIN>) {
 	next;
     }
 
+    # memalign ("m") and calloc ("c") requests allocate just like "a"
+    if ($cmd eq "m" or $cmd eq "c") {
+	$cmd = "a";
+    }
+
     if ($cmd eq "a" and $HASH{$id} eq "a") {
 	die "$0: ERROR[$linenum]: allocate with no intervening free.\n";
     }
@@ -0,0 +1,109 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+# Mixes calloc requests ("c <id> <size>") with mallocs, in rounds that
+# make the allocator hand calloc every kind of memory it can get: blocks
+# freed a moment ago, pages purged after sitting free for the purge
+# decay, the top of the heap after a trim, and fresh huge mappings.
+# Each round
+#   - allocates large (2-24 KB) and small (16-256 byte) blocks, half of
+#     them with calloc, and now and then a huge one over the default
+#     mmap threshold;
+#   - frees every other large block, leaving free pages between live ones;
+#   - churns small blocks long enough for those pages to be purged;
+#   - callocs blocks of the freed sizes, which reuse the holes, and
+#     reallocs a few blocks;
+#   - frees all but a few survivors, top first, so the heap is trimmed.
+# The survivors are freed at the end, so the trace is balanced.
+
+$out_filename = $argv[0];
+$out_filename = "calloc.rep" unless $out_filename;
+$num_rounds = $argv[1];
+$num_rounds = 8 unless $num_rounds;
+
+$num_ids = 0;
+
+sub alloc
+{
+    my ($size) = @_;
+    my $id = $num_ids++;
+    push @ops, (rand() < 0.5 ? "c" : "a") . " $id $size";
+    return $id;
+}
+
+sub calloc
+{
+    my ($size) = @_;
+    my $id = $num_ids++;
+    push @ops, "c $id $size";
+    return $id;
+}
+
+for ($round = 0; $round < $num_rounds; $round++) {
+    @large = ();
+    @small = ();
+    %size = ();
+
+    # build up about a megabyte
+    for ($i = 0; $i < 80; $i++) {
+        $s = 2048 + int(rand 22 * 1024);
+        $id = alloc($s);
+        $size{$id} = $s;
+        push @large, $id;
+        push @small, alloc(16 + int(rand 240)) if (rand() < 0.75);
+    }
+    push @small, calloc(131072 + int(rand 131072)) if (rand() < 0.5);
+
+    # punch holes with whole free pages in them
+    @holes = ();
+    for ($i = 0; $i < @large; $i += 2) {
+        push @ops, "f $large[$i]";
+        push @holes, $size{$large[$i]};
+        $large[$i] = -1;
+    }
+
+    # outlast the purge decay with small requests
+    for ($i = 0; $i < 600; $i++) {
+        $id = alloc(16 + int(rand 240));
+        push @ops, "f $id";
+    }
+
+    # calloc into the holes, some purged and some not
+    foreach $s (@holes) {
+        push @large, calloc($s + int(rand 512) - 256);
+    }
+    for ($i = 1; $i < @large; $i += 8) {
+        next if ($large[$i] < 0);
+        push @ops, "r $large[$i] " . (1024 + int(rand 32 * 1024));
+    }
+
+    # free all but a few, the newest (highest) first, to trim the top
+    @live = grep { $_ >= 0 } (@large, @small);
+    foreach $id (reverse @live) {
+        if (rand() < 0.05) {
+            push @survivors, $id;
+        } else {
+            push @ops, "f $id";
+        }
+    }
+}
+foreach $id (@survivors) {
+    push @ops, "f $id";
+}
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Header: weight, number of ids, number of ops, ignore-ranges
+$num_ops = @ops;
+
+print OUTFILE "1\n";
+print OUTFILE "$num_ids\n";
+print OUTFILE "$num_ops\n";
+print OUTFILE "0\n";
+
+foreach $op (@ops) {
+    print OUTFILE "$op\n";
+}
+
+close OUTFILE;
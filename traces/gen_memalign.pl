@@ -0,0 +1,68 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+
+# Mixes plain mallocs with aligned requests ("m <id> <size> <align>"),
+# the way SIMD code asks for 32- and 64-byte aligned buffers next to
+# ordinary objects, plus a few page-aligned ones.
+
+$out_filename = $argv[0];
+$out_filename = "memalign.rep" unless $out_filename;
+$num_blocks = $argv[1];
+$num_blocks = 2400 unless $num_blocks;
+$max_blk_size = $argv[2];
+$max_blk_size = 8192 unless $max_blk_size;
+
+@aligns = (16, 32, 32, 64, 64, 128, 4096);
+
+# Create trace
+# Make a series of malloc()s and memalign()s
+for ($i = 0;  $i < $num_blocks; $i += 1) {
+    $op = {};
+    $op->{seq} = $i;
+    if (rand() < 0.5) {
+        $op->{type} = "a";
+        $op->{size} = int(rand $max_blk_size / 4) + 1;
+    } else {
+        $op->{type} = "m";
+        $op->{align} = $aligns[int(rand @aligns)];
+        $op->{size} = $op->{align} * (int(rand $max_blk_size / $op->{align}) + 1);
+    }
+    push @trace, $op;
+}
+# Insert free()s in proper places
+for ($i = 0;  $i < $num_blocks; $i += 1) {
+    for ($minval = $i; $minval < $num_blocks + $i; $minval += 1) {
+        if (($trace[$minval]->{type} ne "f") && ($trace[$minval]->{seq} == $i)) {
+            last;
+        }
+    }
+    $pos = int(rand($num_blocks + $i - $minval - 1) + $minval + 1);
+    $op = {};
+    $op->{type} = "f";
+    $op->{seq} = $i;
+    splice @trace, $pos, 0, $op;
+}
+
+# Open output file
+open OUTFILE, ">$out_filename" or die "Cannot create $out_filename\n";
+
+# Header: weight, number of ids, number of ops, ignore-ranges
+$num_ops = 2*$num_blocks;
+
+print OUTFILE "1\n";
+print OUTFILE "$num_blocks\n";
+print OUTFILE "$num_ops\n";
+print OUTFILE "0\n";
+
+for ($i = 0;  $i < 2*$num_blocks; $i += 1) {
+    if ($trace[$i]->{type} eq "a") {
+        print OUTFILE "$trace[$i]->{type} $trace[$i]->{seq} $trace[$i]->{size}\n";
+    } elsif ($trace[$i]->{type} eq "m") {
+        print OUTFILE "$trace[$i]->{type} $trace[$i]->{seq} $trace[$i]->{size} $trace[$i]->{align}\n";
+    } else {
+        print OUTFILE "$trace[$i]->{type} $trace[$i]->{seq}\n";
+    }
+}
+
+close OUTFILE;
+
@@ -0,0 +1,97 @@
+#!/usr/bin/perl
+#!/usr/local/bin/perl
+use Getopt::Std;
+
+#######################################################################
+# rep2bin - convert a text trace file to the binary trace format.
+#
+# Reads a .rep trace on stdin and writes the binary trace on stdout.
+# mdriver tells the two formats apart by the magic number, so the
+# result is run like any trace, e.g. "mdriver -f traces/alaska.bin".
+#
+# The header is the magic "MMTRACE1" and six little-endian 32-bit
+# words: flags, weight, num_ids, num_ops, ignore_ranges and a zero.
+# The ops follow as 16-byte records (type, id, size, alignment), which
+# the driver replays straight from the mapped file. With -z they are
+# varint-encoded instead (see tracehdr_t in mdriver.c), about a fifth
+# of the size, but then they are decoded when the trace is loaded.
+#
+#######################################################################
+
+%TYPES = ("a" => 0, "f" => 1, "r" => 2, "m" => 3, "c" => 4);
+
+#
+# void usage(void) - print help message and terminate
+#
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-hz] < in.rep > out.bin\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h          Print this message\n";
+    printf STDERR "  -z          Varint-encode the ops\n";
+    die "\n" ;
+}
+
+# Unsigned LEB128: 7 bits per byte, high bit set on all but the last
+sub varint
+{
+    my $v = $_[0];
+    my $s = "";
+    while ($v >= 0x80) {
+        $s .= chr(($v & 0x7f) | 0x80);
+        $v >>= 7;
+    }
+    return $s . chr($v);
+}
+
+##############
+# Main routine
+##############
+
+getopts('hz');
+if ($opt_h) {
+    usage("");
+}
+
+# Read the trace header values
+@header = ();
+while (@header < 4 && defined($line = <STDIN>)) {
+    push(@header, split(" ", $line));
+}
+($weight, $num_ids, $num_ops, $ignore_ranges) = @header;
+defined($ignore_ranges) or usage("Truncated trace header");
+
+binmode STDOUT;
+print pack("a8 V6", "MMTRACE1", $opt_z ? 1 : 0,
+           $weight, $num_ids, $num_ops, $ignore_ranges, 0);
+
+$prev = 0;
+$size = 0;
+for ($i = 0; $i < $num_ops; $i++) {
+    $line = <STDIN>;
+    defined($line) or die "Trace ends after $i of $num_ops requests\n";
+    ($cmd, $id, @args) = split(" ", $line);
+
+    # ignore blank lines
+    if (!$cmd) {
+        $i--;
+        next;
+    }
+    exists($TYPES{$cmd}) or die "Bogus request type $cmd\n";
+    $type = $TYPES{$cmd};
+    # like the driver, a request that lacks its size reuses the last one
+    $size = $args[0] if ($cmd ne "f" && defined($args[0]));
+    $align = $cmd eq "m" ? $args[1] : 0;
+
+    if (!$opt_z) {
+        print pack("V l< V V", $type, $id, $cmd eq "f" ? 0 : $size, $align);
+        next;
+    }
+    # zigzag the id difference so that small negative ones stay short
+    $delta = $id - $prev;
+    $prev = $id;
+    print chr($type), varint($delta >= 0 ? 2 * $delta : -2 * $delta - 1);
+    print varint($size) if ($cmd ne "f");
+    print varint($align) if ($cmd eq "m");
+}